@@ -8,3 +8,5 @@ set(MCS OFF CACHE BOOL "MCS kernel")
 set(UINTR OFF CACHE BOOL "(if supported) RISC-V uintr feature")
 set(QEMU_BINARY "" CACHE STRING "Custom QEMU executable binary")
 set(KernelSel4Arch "riscv64" CACHE STRING "aarch32, aarch64, arm_hyp, ia32, x86_64, riscv32, riscv64")
+set(FS_BSIZE "1024" CACHE STRING "xv6fs block size chosen at format time (1024, 4096 or 8192)")
+set(FS_EXTENTS OFF CACHE BOOL "xv6fs inodes map blocks by extent instead of indirect blocks")
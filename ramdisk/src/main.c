@@ -14,16 +14,37 @@
 #include <service/env.h>
 #include <service/syscall.h>
 
-#define BSIZE 1024
+#define DEFAULT_BSIZE 1024
+#define MAX_BSIZE 8192
+/* size of the buffer shared with xv6fs, see FS_RAM_PAGES in rootserver */
+#define CLIENT_BUF_SIZE (16 * 4096)
 #define MAX_RAMDISK_PAGES 16
 #define MAX_RAMDISK_SIZE (MAX_RAMDISK_PAGES * 2 * 1024 * 1024)
 
+/* multi-block requests; keep in sync with xv6fs/src/defs.h */
+#define DISK_WRITEN 0x200
+#define DISK_READN 0x201
+
 /* start at a virtual address below KERNEL_RESERVED_START */
 /* this address is a hack to vspace, do not change it !*/
 #define RAMDISK_BASE 0x20000000
 
 static init_data_t init_data;
 
+/* block size of the file system on top, set by DISK_INIT */
+static int bsize = DEFAULT_BSIZE;
+
+static int disk_init(seL4_Word size) {
+  if (size < DEFAULT_BSIZE || size > MAX_BSIZE || (size & (size - 1)))
+    return -EINVAL;
+  /* a block must fit behind the lock and the request words */
+  if (sizeof(struct spinlock) + 3 * sizeof(seL4_Word) + size > CLIENT_BUF_SIZE)
+    return -EINVAL;
+  bsize = size;
+  printf("[ramdisk] initialize xv6fs with %d-byte blocks\n", bsize);
+  return 0;
+}
+
 void __plat_putchar(int c);
 static size_t write_buf(void *data, size_t count) {
   char *buf = data;
@@ -68,19 +89,29 @@ int main(int argc, char **argv) {
     seL4_MessageInfo_t info = seL4_Recv(client_ep, NULL);
     switch (seL4_MessageInfo_get_label(info)) {
     case DISK_INIT:
-      printf("[ramdisk] initialize xv6fs \n");
+      ret = disk_init(seL4_GetMR(0));
       break;
     case DISK_READ:
       blockno = seL4_GetMR(0);
       // printf("[ramdisk] read %d\n", blockno);
-      memmove(init_data->client_buf, (void *)RAMDISK_BASE + blockno * BSIZE,
-              BSIZE);
+      memmove(init_data->client_buf, (void *)RAMDISK_BASE + blockno * bsize,
+              bsize);
       break;
     case DISK_WRITE:
       blockno = seL4_GetMR(0);
       // printf("[ramdisk] write %d\n", blockno);
-      memmove((void *)RAMDISK_BASE + blockno * BSIZE, init_data->client_buf,
-              BSIZE);
+      memmove((void *)RAMDISK_BASE + blockno * bsize, init_data->client_buf,
+              bsize);
+      break;
+    case DISK_WRITEN:
+      blockno = seL4_GetMR(0);
+      memmove((void *)RAMDISK_BASE + blockno * bsize, init_data->client_buf,
+              seL4_GetMR(1) * bsize);
+      break;
+    case DISK_READN:
+      blockno = seL4_GetMR(0);
+      memmove(init_data->client_buf, (void *)RAMDISK_BASE + blockno * bsize,
+              seL4_GetMR(1) * bsize);
       break;
     default:
       ret = -EINVAL;
@@ -90,7 +121,7 @@ int main(int argc, char **argv) {
     seL4_SetMR(0, ret);
     seL4_Reply(info);
 #elif defined(TEST_POLL)
-    seL4_Word *buf;
+    seL4_Word *buf = init_data->client_buf;
     acquire(init_data->client_lk);
     argint(-1, &label);
     if (!label) {
@@ -99,21 +130,29 @@ int main(int argc, char **argv) {
     }
     switch (label) {
     case DISK_INIT:
-      printf("[ramdisk] initialize xv6fs \n");
+      ret = disk_init(buf[1]);
       break;
     case DISK_READ:
-      buf = init_data->client_buf;
       blockno = buf[1];
       // printf("[ramdisk] read %d\n", blockno);
-      memmove(&buf[2], (void *)RAMDISK_BASE + blockno * BSIZE,
-              BSIZE);
+      memmove(&buf[2], (void *)RAMDISK_BASE + blockno * bsize,
+              bsize);
       break;
     case DISK_WRITE:
-      buf = init_data->client_buf;
       blockno = buf[1];
       // printf("[ramdisk] write %d\n", blockno);
-      memmove((void *)RAMDISK_BASE + blockno * BSIZE, &buf[2],
-              BSIZE);
+      memmove((void *)RAMDISK_BASE + blockno * bsize, &buf[2],
+              bsize);
+      break;
+    case DISK_WRITEN:
+      blockno = buf[1];
+      memmove((void *)RAMDISK_BASE + blockno * bsize, &buf[3],
+              buf[2] * bsize);
+      break;
+    case DISK_READN:
+      blockno = buf[1];
+      memmove(&buf[3], (void *)RAMDISK_BASE + blockno * bsize,
+              buf[2] * bsize);
       break;
     default:
       ret = -EINVAL;
@@ -133,19 +172,29 @@ int main(int argc, char **argv) {
     argint(-1, &label);
     switch (label) {
     case DISK_INIT:
-      printf("[ramdisk] initialize xv6fs \n");
+      ret = disk_init(buf[1]);
       break;
     case DISK_READ:
       blockno = buf[1];
       // printf("[ramdisk] read %d\n", blockno);
-      memmove(&buf[2], (void *)RAMDISK_BASE + blockno * BSIZE,
-              BSIZE);
+      memmove(&buf[2], (void *)RAMDISK_BASE + blockno * bsize,
+              bsize);
       break;
     case DISK_WRITE:
       blockno = buf[1];
       // printf("[ramdisk] write %d\n", blockno);
-      memmove((void *)RAMDISK_BASE + blockno * BSIZE, &buf[2],
-              BSIZE);
+      memmove((void *)RAMDISK_BASE + blockno * bsize, &buf[2],
+              bsize);
+      break;
+    case DISK_WRITEN:
+      blockno = buf[1];
+      memmove((void *)RAMDISK_BASE + blockno * bsize, &buf[3],
+              buf[2] * bsize);
+      break;
+    case DISK_READN:
+      blockno = buf[1];
+      memmove(&buf[3], (void *)RAMDISK_BASE + blockno * bsize,
+              buf[2] * bsize);
       break;
     default:
       ret = -EINVAL;
@@ -48,6 +48,14 @@ extern char _cpio_archive_end[];
 
 #define MAX_ARG_NUM 10
 
+/* pages shared between the app and xv6fs; see xv6fs/src/defs.h */
+#define APP_FS_PAGES (2 + 256)
+
+/* pages shared between xv6fs and the ramdisk; they must hold the
+ * largest block run plus the request header, see DISKBUF in
+ * xv6fs/src/defs.h and CLIENT_BUF_SIZE in ramdisk/src/main.c */
+#define FS_RAM_PAGES 16
+
 int untypedList_allocated
     [CONFIG_MAX_NUM_BOOTINFO_UNTYPED_CAPS]; /* information about each untyped */
 
@@ -166,24 +174,26 @@ void *main_continued(void *arg UNUSED) {
   config_app(&env, &env.fs, "xv6fs", 2);
   config_app(&env, &env.app, "sqlite3", 3);
 
-  env.app_fs_buf =
-      vspace_new_pages(&env.vspace, seL4_AllRights, 2, CUSTOM_IPC_BUFFER_BITS);
+  /* request pages, then the xv6fs map window (FSMAPOFF, FSMAPSIZE) */
+  env.app_fs_buf = vspace_new_pages(&env.vspace, seL4_AllRights, APP_FS_PAGES,
+                                    CUSTOM_IPC_BUFFER_BITS);
   env.app.init->client_buf = NULL;
   env.app.init->server_buf =
-      vspace_share_mem(&env.vspace, &env.app.proc.vspace, env.app_fs_buf, 2,
-                       CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
+      vspace_share_mem(&env.vspace, &env.app.proc.vspace, env.app_fs_buf,
+                       APP_FS_PAGES, CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
   env.fs.init->client_buf =
-      vspace_share_mem(&env.vspace, &env.fs.proc.vspace, env.app_fs_buf, 2,
-                       CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
+      vspace_share_mem(&env.vspace, &env.fs.proc.vspace, env.app_fs_buf,
+                       APP_FS_PAGES, CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
 
-  env.fs_ram_buf =
-      vspace_new_pages(&env.vspace, seL4_AllRights, 2, CUSTOM_IPC_BUFFER_BITS);
+  /* room for a run of blocks; must match DISKBUF in xv6fs/src/defs.h */
+  env.fs_ram_buf = vspace_new_pages(&env.vspace, seL4_AllRights, FS_RAM_PAGES,
+                                    CUSTOM_IPC_BUFFER_BITS);
   env.fs.init->server_buf =
-      vspace_share_mem(&env.vspace, &env.fs.proc.vspace, env.fs_ram_buf, 2,
-                       CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
-  env.ramdisk.init->client_buf =
-      vspace_share_mem(&env.vspace, &env.ramdisk.proc.vspace, env.fs_ram_buf, 2,
-                       CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
+      vspace_share_mem(&env.vspace, &env.fs.proc.vspace, env.fs_ram_buf,
+                       FS_RAM_PAGES, CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
+  env.ramdisk.init->client_buf = vspace_share_mem(
+      &env.vspace, &env.ramdisk.proc.vspace, env.fs_ram_buf, FS_RAM_PAGES,
+      CUSTOM_IPC_BUFFER_BITS, seL4_AllRights, 1);
   env.ramdisk.init->server_buf = NULL;
 
 #ifdef TEST_NORMAL
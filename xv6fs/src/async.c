@@ -0,0 +1,89 @@
+// Asynchronous requests.
+//
+// Besides the one blocking request at a time that the transports
+// carry, the app can keep many requests in flight through a
+// struct fsring (see defs.h) that it places in a shared-memory
+// region of the map window (FS_SHM_MAP) and registers with
+// FS_ASYNC_SETUP. It queues struct fsreq entries at sqtail, each
+// naming its data buffer by window offset, and collects struct
+// fscqe completions at cqhead, matched to requests by ticket.
+//
+// The server takes submissions whenever it would otherwise poll
+// idle, so under TEST_POLL and TEST_UINTR the app just submits
+// and later reaps. FS_ASYNC_ENTER runs the pending submissions
+// at once; a TEST_NORMAL client, whose server only runs when
+// called, uses it to submit a batch in one call.
+//
+// The sqlite benchmark has no async mode yet. It reaches the
+// server only through the sel4service library's syscall table
+// (init_syscall_table), which carries the FS_* labels of
+// <service/syscall.h> and has no entry point for sending any
+// other label. FS_SHM_MAP also passes its name through argstr,
+// whose encoding is private to that library.
+
+#include "defs.h"
+
+static struct fsring *ring;
+
+// Use the struct fsring at window offset woff.
+int asyncsetup(uint woff) {
+  struct fsring *r;
+
+  if (woff % 8 || (r = mapaddr(woff, sizeof(struct fsring))) == 0)
+    return -EINVAL;
+  r->sqhead = r->sqtail = 0;
+  r->cqhead = r->cqtail = 0;
+  ring = r;
+  return 0;
+}
+
+// Carry out one request. Reads and writes, as FS_PREAD and
+// FS_PWRITE do, leave the file offset unchanged.
+static long asyncdo(struct fsreq *q) {
+  struct file *f;
+  char *p;
+
+  if (q->fd < 0 || q->fd >= NOFILE || (f = curr()->ofile[q->fd]) == 0)
+    return -EBADF;
+  switch (q->label) {
+  case FS_PREAD:
+  case FS_PWRITE:
+    if (f->type != FD_INODE)
+      return -ENODEV;
+    if ((p = mapaddr(q->woff, q->len)) == 0)
+      return -EINVAL;
+    return filerwat(f, (uint64)p, q->len, q->off, q->label == FS_PWRITE);
+  case FS_FSYNC:
+    return filesync(f, 0);
+  case FS_FDATASYNC:
+    return filesync(f, 1);
+  default:
+    return -EINVAL;
+  }
+}
+
+// Run up to max submitted requests, as long as there is room for
+// their completions. Returns the number run.
+int asyncrun(int max) {
+  struct fsreq q;
+  uint i;
+  int n;
+
+  if (ring == 0)
+    return 0;
+  for (n = 0; n < max; n++) {
+    if (ring->sqhead == ring->sqtail ||
+        ring->cqtail - ring->cqhead == NFSRING)
+      break;
+    __sync_synchronize();
+    q = ring->sq[ring->sqhead % NFSRING];
+    __sync_synchronize();
+    ring->sqhead++;
+    i = ring->cqtail % NFSRING;
+    ring->cq[i].ticket = q.ticket;
+    ring->cq[i].ret = asyncdo(&q);
+    __sync_synchronize();
+    ring->cqtail++;
+  }
+  return n;
+}
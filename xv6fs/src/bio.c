@@ -7,11 +7,31 @@
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To get a buffer for a block that will be overwritten in
+//     full, call boverwrite, which skips the disk read.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * After changing metadata, call log_write (see log.c). After
+//     changing file data, call bdirty instead: dirty buffers are
+//     written back before they are recycled, by bflush before
+//     each log commit, and by bflushi when their file is synced.
+//
+// Inode and free bitmap blocks are kept in a separate pinned
+// region sized from the superblock (see bmetainit), so the
+// blocks every ialloc, iupdate, ilock, balloc and bfree touch
+// are never evicted by file data. The superblock itself is
+// kept in memory as sb.
+//
+// balloc does not clear a new block on disk; it calls bmarkzero,
+// and bread serves the block as zeros from memory until its
+// contents are first written back. A committed inode may point
+// at such a block, so bflush writes zeros to every one still
+// unwritten before the log commits.
+
+#include <stdlib.h>
 
 #include "defs.h"
 
@@ -23,6 +43,20 @@ struct {
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
   struct buf head;
+
+  // Pinned metadata blocks [metastart, metastart + nmeta).
+  struct buf *meta;
+  uint metadev;
+  uint metastart;
+  uint nmeta;
+
+  // One bit per block of metadev: block reads as zeros.
+  uint64 *zero;
+  uint nzero;
+  // One bit per block of metadev: marked zero, but the disk
+  // still holds its old contents.
+  uint64 *unwritten;
+  uint nunwritten;
 } bcache;
 
 void binit(void) {
@@ -42,6 +76,69 @@ void binit(void) {
   }
 }
 
+// Pin the metadata blocks [start, start + n) of device dev in
+// memory. Called by fsinit once the superblock is known and
+// before any inode or bitmap block is read.
+void bmetainit(uint dev, uint start, uint n) {
+  struct buf *b;
+
+  bcache.meta = calloc(n, sizeof(struct buf));
+  if (bcache.meta == 0)
+    panic("bmetainit");
+  for (b = bcache.meta; b < bcache.meta + n; b++) {
+    b->dev = dev;
+    b->blockno = start + (b - bcache.meta);
+  }
+  bcache.metadev = dev;
+  bcache.metastart = start;
+  bcache.nmeta = n;
+}
+
+// Track known-zero state for the n blocks of the device.
+void bzeroinit(uint n) {
+  bcache.zero = calloc((n + 63) / 64, sizeof(uint64));
+  bcache.unwritten = calloc((n + 63) / 64, sizeof(uint64));
+  if (bcache.zero == 0 || bcache.unwritten == 0)
+    panic("bzeroinit");
+  bcache.nzero = n;
+}
+
+static int iszero(uint dev, uint blockno) {
+  return dev == bcache.metadev && blockno < bcache.nzero &&
+         (bcache.zero[blockno / 64] >> (blockno % 64) & 1);
+}
+
+static int isunwritten(uint blockno) {
+  return bcache.unwritten[blockno / 64] >> (blockno % 64) & 1;
+}
+
+// Record that a newly allocated block reads as zeros. Nothing
+// is written to disk until the next bflush; a cached copy of the
+// block's old contents is cleared in place.
+void bmarkzero(uint dev, uint blockno) {
+  struct buf *b;
+
+  if (dev != bcache.metadev || blockno >= bcache.nzero)
+    panic("bmarkzero");
+  bcache.zero[blockno / 64] |= (uint64)1 << (blockno % 64);
+  if (!isunwritten(blockno)) {
+    bcache.unwritten[blockno / 64] |= (uint64)1 << (blockno % 64);
+    bcache.nunwritten++;
+  }
+  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+    if (b->dev == dev && b->blockno == blockno) {
+      memset(b->data, 0, BSIZE);
+      b->valid = 1;
+      b->dirty = 0;
+      break;
+    }
+  }
+}
+
+static int ismeta(struct buf *b) {
+  return b >= bcache.meta && b < bcache.meta + bcache.nmeta;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -50,6 +147,14 @@ static struct buf *bget(uint dev, uint blockno) {
 
   //   acquire(&bcache.lock);
 
+  // Is the block pinned metadata?
+  if (dev == bcache.metadev && blockno >= bcache.metastart &&
+      blockno < bcache.metastart + bcache.nmeta) {
+    b = &bcache.meta[blockno - bcache.metastart];
+    b->refcnt++;
+    return b;
+  }
+
   // Is the block already cached?
   for (b = bcache.head.next; b != &bcache.head; b = b->next) {
     if (b->dev == dev && b->blockno == blockno) {
@@ -64,6 +169,8 @@ static struct buf *bget(uint dev, uint blockno) {
   // Recycle the least recently used (LRU) unused buffer.
   for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
     if (b->refcnt == 0) {
+      if (b->dirty)
+        bwrite(b);
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
@@ -82,19 +189,196 @@ struct buf *bread(uint dev, uint blockno) {
 
   b = bget(dev, blockno);
   if (!b->valid) {
-    disk_rw(b->data, b->blockno, 0);
+    if (iszero(dev, blockno))
+      memset(b->data, 0, BSIZE);
+    else
+      disk_rw(b->data, b->blockno, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Return a locked buf for a block the caller is about to
+// overwrite completely, without reading it from disk.
+struct buf *boverwrite(uint dev, uint blockno) {
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
+// Note that block blockno has been written to disk.
+static void bnotzero(uint dev, uint blockno) {
+  if (!iszero(dev, blockno))
+    return;
+  bcache.zero[blockno / 64] &= ~((uint64)1 << (blockno % 64));
+  if (isunwritten(blockno)) {
+    bcache.unwritten[blockno / 64] &= ~((uint64)1 << (blockno % 64));
+    bcache.nunwritten--;
+  }
+}
+
+// Write zeros to every known-zero block whose old contents are
+// still on disk, in runs of up to NDISKRUN blocks. The blocks
+// stay known-zero, so they are still not read back.
+static void bwritezero(void) {
+  static char zeroblock[MAXBSIZE];
+  static void *data[NBUF];
+  uint b, n, i;
+
+  for (i = 0; i < NBUF; i++)
+    data[i] = zeroblock;
+  for (b = 0; b < bcache.nzero && bcache.nunwritten > 0; b += n) {
+    if (bcache.unwritten[b / 64] == 0) {
+      n = 64 - b % 64;
+      continue;
+    }
+    for (n = 0; b + n < bcache.nzero && n < NDISKRUN && n < NBUF &&
+                isunwritten(b + n);
+         n++)
+      bcache.unwritten[(b + n) / 64] &= ~((uint64)1 << ((b + n) % 64));
+    if (n == 0) {
+      n = 1;
+      continue;
+    }
+    if (n == 1)
+      disk_rw(zeroblock, b, 1);
+    else
+      disk_writen(data, b, n);
+    bcache.nunwritten -= n;
+  }
+}
+
+// Note that b's contents are now on disk.
+static void bwritten(struct buf *b) {
+  b->dirty = 0;
+  bnotzero(b->dev, b->blockno);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b) {
   //   if (!holdingsleep(&b->lock))
   //     panic("bwrite");
   disk_rw(b->data, b->blockno, 1);
+  bwritten(b);
+}
+
+// Record that file data in b, belonging to inode inum, has been
+// modified, so that it is written back before the buffer is
+// recycled.
+void bdirty(struct buf *b, uint inum) {
+  b->dirty = 1;
+  b->inum = inum;
+}
+
+// Write back the dirty buffers of device dev that belong to inode
+// inum, or all of them if inum is 0. The buffers are sorted by
+// block number and runs of consecutive blocks go to the disk in
+// one DISK_WRITEN request each.
+static void bwriteback(uint dev, uint inum) {
+  static struct buf *w[NBUF];
+  static void *data[NBUF];
+  struct buf *b;
+  int i, j, k, n;
+
+  n = 0;
+  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    if (!b->dirty || (inum && (b->dev != dev || b->inum != inum)))
+      continue;
+    for (i = n++; i > 0 && (w[i - 1]->dev > b->dev ||
+                            (w[i - 1]->dev == b->dev &&
+                             w[i - 1]->blockno > b->blockno));
+         i--)
+      w[i] = w[i - 1];
+    w[i] = b;
+  }
+
+  for (i = 0; i < n; i = j) {
+    data[0] = w[i]->data;
+    for (j = i + 1; j < n && j - i < NDISKRUN && w[j]->dev == w[i]->dev &&
+                    w[j]->blockno == w[i]->blockno + (j - i);
+         j++)
+      data[j - i] = w[j]->data;
+    if (j - i == 1)
+      disk_rw(data[0], w[i]->blockno, 1);
+    else
+      disk_writen(data, w[i]->blockno, j - i);
+    for (k = i; k < j; k++)
+      bwritten(w[k]);
+  }
+}
+
+// The cached copy of a block, or 0. Does not take a reference.
+static struct buf *bpeek(uint dev, uint blockno) {
+  struct buf *b;
+
+  if (dev == bcache.metadev && blockno >= bcache.metastart &&
+      blockno < bcache.metastart + bcache.nmeta) {
+    b = &bcache.meta[blockno - bcache.metastart];
+    return b->valid ? b : 0;
+  }
+  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+    if (b->dev == dev && b->blockno == blockno)
+      return b->valid ? b : 0;
+  }
+  return 0;
+}
+
+// Read (write == 0) or write the n consecutive blocks from
+// blockno straight between data and the disk, without caching
+// them. A cached copy is read from instead of the disk, since it
+// may be newer, and is updated by a write; a known-zero block is
+// not read at all. Runs of other blocks go to the disk in one
+// request each.
+void bdirect(uint dev, uint blockno, uint n, char *data, int write) {
+  static void *v[NBUF];
+  struct buf *b;
+  uint i, j;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i; j < n && j - i < NDISKRUN && j - i < NBUF &&
+                (b = bpeek(dev, blockno + j)) == 0 &&
+                (write || !iszero(dev, blockno + j));
+         j++)
+      v[j - i] = data + j * BSIZE;
+    if (j - i > 1) {
+      if (write)
+        disk_writen(v, blockno + i, j - i);
+      else
+        disk_readn(v, blockno + i, j - i);
+    } else if (j > i) {
+      disk_rw(v[0], blockno + i, write);
+    } else {
+      b = bpeek(dev, blockno + i);
+      if (write) {
+        memmove(b->data, data + i * BSIZE, BSIZE);
+        disk_rw(b->data, blockno + i, 1);
+        b->dirty = 0;
+      } else if (b) {
+        memmove(data + i * BSIZE, b->data, BSIZE);
+      } else {
+        memset(data + i * BSIZE, 0, BSIZE);
+      }
+      j = i + 1;
+    }
+    if (write) {
+      for (; i < j; i++)
+        bnotzero(dev, blockno + i);
+    }
+  }
+}
+
+// Write back every dirty buffer, and zero the blocks that only
+// read as zeros in memory.
+void bflush(void) {
+  bwriteback(0, 0);
+  bwritezero();
 }
 
+// Write back the dirty data of inode inum on device dev.
+void bflushi(uint dev, uint inum) { bwriteback(dev, inum); }
+
 // Release a locked buffer.
 // Move to the head of the most-recently-used list.
 void brelse(struct buf *b) {
@@ -105,7 +389,7 @@ void brelse(struct buf *b) {
 
   //   acquire(&bcache.lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
+  if (b->refcnt == 0 && !ismeta(b)) {
     // no one is waiting for it.
     b->next->prev = b->prev;
     b->prev->next = b->next;
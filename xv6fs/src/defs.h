@@ -37,20 +37,67 @@ typedef unsigned long uint64;
 #define O_TMPFILE 020200000
 #define O_NDELAY O_NONBLOCK
 
+// xv6fs requests that service/syscall.h does not define.
+enum {
+  FS_FALLOCATE = 0x100,
+  FS_GETDENTS,
+  FS_PREADV,
+  FS_PWRITEV,
+  FS_PREAD_STREAM,
+  FS_PWRITE_STREAM,
+  FS_FSYNC,
+  FS_FDATASYNC,
+  FS_MMAP,
+  FS_MSYNC,
+  FS_MUNMAP,
+  FS_SHM_MAP,
+  FS_SHM_UNMAP,
+  FS_ASYNC_SETUP,
+  FS_ASYNC_ENTER,
+  FS_COMPOUND,
+  FS_LEASE_SETUP,
+};
+
+// ramdisk requests that service/syscall.h does not define.
+// Keep in sync with ramdisk/src/main.c.
+enum {
+  DISK_WRITEN = 0x200, // write n consecutive blocks
+  DISK_READN,          // read n consecutive blocks
+};
+
 // params.h
 #define NPROC 64                  // maximum number of processes
 #define NCPU 8                    // maximum number of CPUs
 #define NOFILE 16                 // open files per process
 #define NFILE 100                 // open files per system
-#define NINODE 50                 // maximum number of active i-nodes
+#define NINODE 256                // i-node table entries before unused ones are reused
 #define NDEV 10                   // maximum major device number
 #define ROOTDEV 1                 // device number of file system root disk
 #define MAXARG 32                 // max exec arguments
-#define MAXOPBLOCKS 10            // max # of blocks any FS op writes
+#define MAXOPBLOCKS 16            // max # of metadata blocks any FS op writes
 #define LOGSIZE (MAXOPBLOCKS * 3) // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)    // size of disk block cache
-#define FSSIZE 32 * 1024           // size of file system in blocks
+#define NBUF (LOGSIZE * 2)        // size of disk block cache
+#define FSBYTES (32 * 1024 * 1024) // size of file system in bytes
+#define FSSIZE (FSBYTES / BSIZE)   // size of file system in blocks
 #define MAXPATH 128               // maximum file path name
+#define NRESERVE 32               // blocks reserved ahead of a growing file
+#define NRECLAIM 256              // blocks freed per idle reclaim slice
+#define NDIRLINEAR 2              // directory blocks searched linearly
+#define NDCACHE 512               // directory name cache entries
+#define NIDLECOMMIT 64            // idle polls before the log is committed
+#define NREQCOMMIT 64             // requests before the log is committed
+#define NFREELOW 8                // commit early below 1/NFREELOW free
+#define NBMCACHE 8                // block-map runs cached per inode
+#define DISKBUF (16 * 4096)       // fs<->ramdisk shared buffer, see rootserver
+#define DISKHDR 64                // lock and request words ahead of the data
+#define NDISKRUN ((DISKBUF - DISKHDR) / BSIZE) // blocks per DISK_WRITEN
+#define FSPGSIZE 4096             // page size of the shared buffers
+#define FSMAPOFF (2 * FSPGSIZE)   // map window offset in the app<->fs buffer
+#define FSMAPSIZE (256 * FSPGSIZE) // size of the map window, see rootserver
+#define NFSMAP 32                 // mappings at a time
+#define NSHM 4                    // shared-memory objects at a time
+#define NSHMREGION 16             // regions per shared-memory object
+#define NFSRING 64                // entries in each async queue
 
 // stat.h
 #define T_DIR 1    // Directory
@@ -80,8 +127,15 @@ struct stat {
 // On-disk file system format.
 // Both the kernel and user programs use this header file.
 
-#define ROOTINO 1  // root i-number
-#define BSIZE 1024 // block size
+#define ROOTINO 1       // root i-number
+#define MAXBSIZE 8192   // largest supported block size
+#ifndef FSBSIZE
+#define FSBSIZE 1024    // block size chosen by mkfs (1024, 4096 or 8192)
+#endif
+#ifndef FSEXTENTS
+#define FSEXTENTS 0     // does mkfs choose extent-mapped inodes?
+#endif
+#define BSIZE (sb.bsize) // block size of the mounted file system
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -98,14 +152,46 @@ struct superblock {
   uint logstart;   // Block number of first log block
   uint inodestart; // Block number of first inode block
   uint bmapstart;  // Block number of first free map block
+  uint bsize;      // Block size in bytes
+  uint flags;      // SB_* format options
 };
 
+#define SB_EXTENTS 0x1 // inodes map blocks by extent
+
+extern struct superblock sb;
+
 #define FSMAGIC 0x10203040
 
 #define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define NINDIRECT2 NINDIRECT *NINDIRECT
 #define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT2)
+#define WRITECHUNK (NINDIRECT * BSIZE) // file bytes written per log transaction
+
+// Largest file size in bytes. Extent-mapped files are only
+// limited by the 32-bit size field.
+#define MAXFILESIZE \
+  ((sb.flags & SB_EXTENTS) ? 0xffffffffUL : MAXFILE * BSIZE)
+
+// With SB_EXTENTS, an inode's addrs[] holds NIEXTENT extents
+// followed by the block number of an overflow block, which holds
+// up to NXEXTENT more. Extents are sorted by logical start across
+// both, inline ones first; unused inline slots have len 0.
+struct extent {
+  uint lstart; // first logical block
+  uint pstart; // first physical block
+  uint len;    // number of blocks
+};
+
+struct extblock {
+  uint n; // number of extents in e[]
+  uint pad;
+  struct extent e[];
+};
+
+#define NIEXTENT 4
+#define EXTOVERFLOW (NIEXTENT * sizeof(struct extent) / sizeof(uint))
+#define NXEXTENT ((BSIZE - sizeof(struct extblock)) / sizeof(struct extent))
 
 // On-disk inode structure
 struct dinode {
@@ -137,6 +223,111 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// FS_GETDENTS fills the caller's buffer with these records, each
+// padded to a multiple of 8 bytes. A record's off is the cookie
+// that resumes the listing after it.
+struct fsdirent {
+  uint64 off;
+  uint inum;
+  ushort reclen; // bytes from this record to the next
+  char name[];   // NUL-terminated
+};
+
+// FS_PREADV and FS_PWRITEV take an array of these at the start of
+// the buffer, followed by the data of each one in turn.
+struct fsiovec {
+  uint64 off; // file offset
+  uint64 len;
+};
+
+// FS_PREAD_STREAM and FS_PWRITE_STREAM move a range of any length
+// through the data area in two alternating halves, each headed by
+// this, so that one side fills a half while the other empties the
+// other half. The filling side sets len and then state; the
+// emptying side sets state back to FSS_EMPTY.
+struct fsstream {
+  volatile uint64 state;
+  uint64 len; // bytes of data
+  char data[];
+};
+
+#define FSS_EMPTY 0
+#define FSS_FULL 1
+#define FSS_LAST 2 // full, and the last half of the transfer
+
+// Asynchronous requests (see async.c). The app fills sq[sqtail %
+// NFSRING] and then advances sqtail; the server fills cq[cqtail %
+// NFSRING] and then advances cqtail. The heads are advanced by the
+// consuming side. Data buffers are given as map window offsets.
+struct fsreq {
+  uint64 ticket; // chosen by the app, returned in the completion
+  uint label;    // FS_PREAD, FS_PWRITE, FS_FSYNC or FS_FDATASYNC
+  int fd;
+  uint64 off;    // file offset
+  uint woff;     // data buffer
+  uint len;
+};
+
+struct fscqe {
+  uint64 ticket;
+  long ret; // what the blocking request would have returned
+};
+
+struct fsring {
+  volatile uint sqhead, sqtail;
+  volatile uint cqhead, cqtail;
+  struct fsreq sq[NFSRING];
+  struct fscqe cq[NFSRING];
+};
+
+// FS_COMPOUND runs an array of these, at the start of its buffer,
+// in order and stops at the first that fails. Each names its data
+// (a path, a struct stat, or a read or write buffer) by offset
+// from the start of the buffer, and may give FSC_PREVFD as its fd
+// to use the fd of the last FS_OPEN in the same request.
+struct fsop {
+  uint op;     // FS_OPEN, FS_CLOSE, FS_FSTAT, FS_LSEEK, FS_PREAD,
+               // FS_PWRITE or FS_FSYNC
+  int fd;
+  uint64 arg;  // FS_OPEN: flags; otherwise the file offset
+  uint64 data; // offset of the op's data in the buffer
+  uint len;    // FS_PREAD, FS_PWRITE: bytes; FS_LSEEK: whence
+  long ret;    // set by the server
+};
+
+#define FSC_PREVFD (-2)
+
+// After FS_LEASE_SETUP the server keeps these in the map window, so
+// the client library can answer lseek and fstat without a request.
+// seq is odd while the server updates the table; a reader retries
+// if seq was odd or changed while it read.
+struct fslease {
+  uint open;  // fd refers to a file or device
+  uint64 off; // file offset
+  struct stat st;
+};
+
+struct fsleases {
+  volatile uint seq;
+  struct fslease fd[NOFILE];
+};
+
+// Directory entries per block
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows NDIRLINEAR blocks is rebuilt as a hash
+// table with one block per bucket. The first entry of every bucket
+// block is this header; its inum of 0 makes plain dirent scans skip
+// it, so they still see every name.
+#define DIRMAGIC "dhash"
+
+struct dirhdr {
+  ushort inum; // always 0
+  char magic[6];
+  uint nbucket; // number of buckets, a power of two
+  char pad[DIRSIZ - 6 - sizeof(uint)];
+};
+
 // file.h
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
@@ -146,6 +337,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  char direct;       // FD_INODE opened with O_DIRECT
   short major;       // FD_DEVICE
 };
 
@@ -159,6 +351,10 @@ struct inode {
   uint inum; // Inode number
   int ref;   // Reference count
   int valid; // inode has been read from disk?
+  int dirty; // changed since last written to disk? see iupdate
+  uint mseq; // last log transaction holding changes to ip
+  uint dseq; // same, counting only size and block map changes
+  int nmap;  // number of mappings of ip, see mmap.c
 
   short type; // copy of disk inode
   short major;
@@ -166,6 +362,17 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT + 1 + 1];
+
+  uint goal;  // block to allocate next, 0 if none
+  uint resv;  // first block reserved ahead of the file
+  uint nresv; // number of reserved blocks
+
+  struct extent bmc[NBMCACHE]; // cached block-map runs, see bmap
+  uint bmcnext;                // next bmc[] slot to replace
+
+  struct inode *hnext; // inode table hash chain
+  struct inode *prev;  // LRU or free list, while ref == 0
+  struct inode *next;
 };
 
 // map major device number to device functions.
@@ -182,12 +389,14 @@ extern struct devsw devsw[];
 struct buf {
   int valid; // has data been read from disk?
   int disk;  // does disk "own" buf?
+  int dirty; // modified since it was last written?
+  uint inum; // file whose data this is, while dirty
   uint dev;
   uint blockno;
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar data[MAXBSIZE];
 };
 
 // client.h
@@ -201,11 +410,19 @@ struct client *curr(void);
 
 // bio.c
 void binit(void);
+void bmetainit(uint, uint, uint);
 struct buf *bread(uint, uint);
+struct buf *boverwrite(uint, uint);
+void bzeroinit(uint);
+void bmarkzero(uint, uint);
 void brelse(struct buf *);
 void bwrite(struct buf *);
 void bpin(struct buf *);
 void bunpin(struct buf *);
+void bdirty(struct buf *, uint);
+void bflush(void);
+void bflushi(uint, uint);
+void bdirect(uint, uint, uint, char *, int);
 
 // file.c
 struct file *filealloc(void);
@@ -216,11 +433,48 @@ int fileread(struct file *, uint64, int n);
 int filestat(struct file *, uint64 addr);
 int filewrite(struct file *, uint64, int n);
 int fileseek(struct file *, off_t, int);
+int fileallocate(struct file *, uint64, uint64);
+int filegetdents(struct file *, uint64, int, uint64);
+int filerwat(struct file *, uint64, int, uint64, int);
+int filerwv(struct file *, uint64, int, int);
+int filestream(struct file *, uint64, int, uint64, uint64, int);
+int filesync(struct file *, int);
+int writeop(struct inode *, uint64, uint, uint);
+int leasesetup(uint);
+void leaseupdate(void);
+
+// log.c
+void initlog(int, struct superblock *);
+void log_write(struct buf *);
+void begin_op(void);
+void end_op(void);
+void log_flush(void);
+uint log_seq(void);
+void log_sync(uint);
+
+// mmap.c
+void mapinit(void *);
+void *mapaddr(uint, uint);
+int mapshared(uint64, uint64);
+int mapfile(struct file *, uint, uint, int);
+int mapsync(uint, uint);
+int unmapfile(uint);
+void mapupdate(struct inode *, uint, char *, uint);
+void mapzero(struct inode *);
+int shmmap(char *, int, uint);
+int shmunmap(char *);
+
+// async.c
+int asyncsetup(uint);
+int asyncrun(int);
 
 // fs.c
 void fsinit(int);
+void bheldrelease(void);
 int dirlink(struct inode *, char *, uint);
 struct inode *dirlookup(struct inode *, char *, uint *);
+void dirunlink(struct inode *, char *, uint);
+int dirread(struct inode *, uint64, int, uint *);
 struct inode *ialloc(uint, short);
 struct inode *idup(struct inode *);
 void iinit();
@@ -235,7 +489,12 @@ struct inode *nameiparent(char *, char *);
 int readi(struct inode *, int, uint64, uint, uint);
 void stati(struct inode *, struct stat *);
 int writei(struct inode *, int, uint64, uint, uint);
+int iodirect(struct inode *, uint64, uint, uint, int);
 void itrunc(struct inode *);
+int ireclaim(int);
+int ireclaimable(void);
+int bfreewaiting(void);
+int iallocate(struct inode *, uint, uint);
 
 // sysfile.c
 // uint64 xv6fs_pipe(void);
@@ -255,6 +514,26 @@ uint64 xv6fs_close(void);
 uint64 xv6fs_getcwd(void);
 uint64 xv6fs_lstat(void);
 uint64 xv6fs_lseek(void);
+uint64 xv6fs_fallocate(void);
+uint64 xv6fs_getdents(void);
+uint64 xv6fs_preadv(void);
+uint64 xv6fs_pwritev(void);
+uint64 xv6fs_pread_stream(void);
+uint64 xv6fs_pwrite_stream(void);
+uint64 xv6fs_fsync(void);
+uint64 xv6fs_fdatasync(void);
+uint64 xv6fs_mmap(void);
+uint64 xv6fs_msync(void);
+uint64 xv6fs_munmap(void);
+uint64 xv6fs_shm_map(void);
+uint64 xv6fs_shm_unmap(void);
+uint64 xv6fs_async_setup(void);
+uint64 xv6fs_async_enter(void);
+uint64 xv6fs_compound(void);
+uint64 xv6fs_lease_setup(void);
 
 // main.c
+void disk_init(int bsize);
 void disk_rw(void *buf, int blockno, int write);
+void disk_readn(void **bufs, int blockno, int n);
+void disk_writen(void **bufs, int blockno, int n);
@@ -58,9 +58,9 @@ void fileclose(struct file *f) {
   if (ff.type == FD_PIPE) {
     // pipeclose(ff.pipe, ff.writable);
   } else if (ff.type == FD_INODE || ff.type == FD_DEVICE) {
-    // begin_op();
+    begin_op();
     iput(ff.ip);
-    // end_op();
+    end_op();
   }
 }
 
@@ -82,6 +82,48 @@ int filestat(struct file *f, uint64 addr) {
   return -1;
 }
 
+// Per-fd copies of the offset and stat in the map window, for the
+// client library (see struct fsleases), or 0 until FS_LEASE_SETUP.
+static struct fsleases *leases;
+
+// Keep the leases in the struct fsleases at window offset woff.
+int leasesetup(uint woff) {
+  struct fsleases *l;
+
+  if (woff % 8 || (l = mapaddr(woff, sizeof(struct fsleases))) == 0)
+    return -EINVAL;
+  memset(l, 0, sizeof(*l));
+  leases = l;
+  leaseupdate();
+  return 0;
+}
+
+// Refresh the leases from the open files. Called before every
+// reply, so the reply also carries any size change.
+void leaseupdate(void) {
+  struct fslease *l;
+  struct file *f;
+  int fd;
+
+  if (leases == 0)
+    return;
+  leases->seq++;
+  __sync_synchronize();
+  for (fd = 0; fd < NOFILE; fd++) {
+    l = &leases->fd[fd];
+    f = curr()->ofile[fd];
+    l->open = f && (f->type == FD_INODE || f->type == FD_DEVICE);
+    if (!l->open)
+      continue;
+    l->off = f->off;
+    ilock(f->ip);
+    stati(f->ip, &l->st);
+    iunlock(f->ip);
+  }
+  __sync_synchronize();
+  leases->seq++;
+}
+
 // Seek to offset
 int fileseek(struct file *f, off_t off, int whence) {
   if (f->type == FD_INODE) {
@@ -102,6 +144,233 @@ int fileseek(struct file *f, off_t off, int whence) {
   return -1;
 }
 
+// Preallocate the blocks backing [off, off + len) of file f.
+int fileallocate(struct file *f, uint64 off, uint64 len) {
+  uint n;
+  int r;
+
+  if (f->writable == 0)
+    return -EBADF;
+  if (f->type != FD_INODE)
+    return -ENODEV;
+  // file offsets and sizes are 32 bits, whatever MAXFILESIZE is.
+  if (off > MAXFILESIZE || len > MAXFILESIZE - off ||
+      off + len > 0xffffffffUL)
+    return -EFBIG;
+  // one transaction per chunk, as in filewrite.
+  for (r = 0; r == 0 && len > 0; off += n, len -= n) {
+    n = len < WRITECHUNK ? len : WRITECHUNK;
+    begin_op();
+    ilock(f->ip);
+    r = iallocate(f->ip, off, n);
+    iunlock(f->ip);
+    end_op();
+  }
+  return r < 0 ? -ENOSPC : 0;
+}
+
+// List directory f into addr, n bytes at most, resuming at the
+// cookie off (0 for the first entry). Returns the number of bytes
+// filled, 0 once the listing is complete.
+int filegetdents(struct file *f, uint64 addr, int n, uint64 off) {
+  uint o;
+  int r;
+
+  if (f->type != FD_INODE)
+    return -ENOTDIR;
+  ilock(f->ip);
+  if (f->ip->type != T_DIR) {
+    iunlock(f->ip);
+    return -ENOTDIR;
+  }
+  if (off % sizeof(struct dirent) || off > f->ip->size) {
+    iunlock(f->ip);
+    return -EINVAL;
+  }
+  o = off;
+  r = dirread(f->ip, addr, n, &o);
+  // no room for even one record.
+  if (r == 0 && o < f->ip->size)
+    r = -EINVAL;
+  iunlock(f->ip);
+  return r;
+}
+
+// Write n bytes from src to ip at off, one log transaction per
+// WRITECHUNK bytes. Caller must hold ip->lock.
+int writeop(struct inode *ip, uint64 src, uint off, uint n) {
+  uint tot, m;
+  int r;
+
+  for (tot = 0; tot < n; tot += r) {
+    m = n - tot < WRITECHUNK ? n - tot : WRITECHUNK;
+    begin_op();
+    r = writei(ip, 1, src + tot, off + tot, m);
+    end_op();
+    if (r < 0)
+      return tot > 0 ? tot : r;
+    if (r != m)
+      return tot + r;
+  }
+  return tot;
+}
+
+// Read (write == 0) or write n bytes of file f at off, as
+// fileread and filewrite do, but leave the file offset unchanged.
+int filerwat(struct file *f, uint64 addr, int n, uint64 off, int write) {
+  uint saved;
+  int r;
+
+  if (f->type != FD_INODE)
+    return -EINVAL;
+  if (off > 0xffffffffUL)
+    return -EINVAL;
+  saved = f->off;
+  f->off = off;
+  if (write)
+    r = filewrite(f, addr, n);
+  else
+    r = fileread(f, addr, n);
+  f->off = saved;
+  return r;
+}
+
+// Read (write == 0) or write the cnt pieces of file f described
+// by the struct fsiovec array at addr, whose data follows the
+// array, all under one lock. The array and the data must lie in
+// the app<->fs buffer, and offsets and lengths must fit in 32
+// bits. The file offset is not used or changed. Returns the
+// number of bytes transferred, stopping at the first short piece.
+int filerwv(struct file *f, uint64 addr, int cnt, int write) {
+  struct fsiovec *iov = (struct fsiovec *)addr;
+  uint64 p, n;
+  int i, r, tot;
+
+  if (write ? f->writable == 0 : f->readable == 0)
+    return -EBADF;
+  if (f->type != FD_INODE)
+    return -ENODEV;
+  if (cnt < 0 || !mapshared(addr, (uint64)cnt * sizeof(struct fsiovec)))
+    return -EINVAL;
+
+  // Check every piece before moving any data.
+  p = addr + cnt * sizeof(struct fsiovec);
+  n = 0;
+  for (i = 0; i < cnt; i++) {
+    if (iov[i].off > 0xffffffffUL || iov[i].len > 0xffffffffUL)
+      return -EINVAL;
+    n += iov[i].len;
+  }
+  if (!mapshared(p, n))
+    return -EINVAL;
+
+  tot = 0;
+  ilock(f->ip);
+  for (i = 0; i < cnt; i++) {
+    if (write)
+      r = writeop(f->ip, p, iov[i].off, iov[i].len);
+    else
+      r = readi(f->ip, 1, p, iov[i].off, iov[i].len);
+    if (r > 0)
+      tot += r;
+    if (r != iov[i].len)
+      break;
+    p += r;
+  }
+  iunlock(f->ip);
+  return tot;
+}
+
+// Read (write == 0) or write len bytes of file f at off, streamed
+// through the area of size bytes at addr as two struct fsstream
+// halves (see defs.h). The client drains or fills one half while
+// this fills or drains the other. A write runs until the client
+// marks a half FSS_LAST; a read marks the half holding its last
+// bytes, which may be empty at end of file. Returns the number of
+// bytes transferred.
+int filestream(struct file *f, uint64 addr, int size, uint64 off,
+               uint64 len, int write) {
+  struct fsstream *h[2];
+  uint64 tot, n, chunk;
+  int i, r, last;
+
+  if (write ? f->writable == 0 : f->readable == 0)
+    return -EBADF;
+  if (f->type != FD_INODE)
+    return -ENODEV;
+  if (size < 0 || size / 2 <= sizeof(struct fsstream) + 8)
+    return -EINVAL;
+  chunk = (size / 2 & ~7) - sizeof(struct fsstream);
+  h[0] = (struct fsstream *)addr;
+  h[1] = (struct fsstream *)(addr + (size / 2 & ~7));
+
+  tot = 0;
+  r = 0;
+  ilock(f->ip);
+  for (i = 0, last = 0; !last; i ^= 1) {
+    if (write) {
+      while (h[i]->state == FSS_EMPTY)
+        ;
+      __sync_synchronize();
+      last = h[i]->state == FSS_LAST;
+      n = h[i]->len;
+      // after a failed write, keep draining so the client can
+      // finish; the return value reports what was written, or
+      // -EINVAL if a half claimed more than it holds.
+      if (r >= 0 && n > chunk)
+        r = -EINVAL;
+      if (r >= 0 && n > 0) {
+        r = writeop(f->ip, (uint64)h[i]->data, off + tot, n);
+        if (r > 0)
+          tot += r;
+        if (r != n)
+          r = -1;
+      }
+      __sync_synchronize();
+      h[i]->state = FSS_EMPTY;
+    } else {
+      while (h[i]->state != FSS_EMPTY)
+        ;
+      n = len - tot < chunk ? len - tot : chunk;
+      r = readi(f->ip, 1, (uint64)h[i]->data, off + tot, n);
+      if (r < 0)
+        r = 0;
+      tot += r;
+      last = r < n || tot == len;
+      h[i]->len = r;
+      __sync_synchronize();
+      h[i]->state = last ? FSS_LAST : FSS_FULL;
+    }
+  }
+  iunlock(f->ip);
+  return r == -EINVAL ? r : tot;
+}
+
+// Write file f's data and metadata to disk. With datasync, a
+// change that does not affect reading the data back, such as to
+// the link count, is left in the log.
+int filesync(struct file *f, int datasync) {
+  struct inode *ip;
+  uint seq;
+
+  if (f->type != FD_INODE)
+    return -EINVAL;
+  ip = f->ip;
+  ilock(ip);
+  bflushi(ip->dev, ip->inum);
+  if (ip->dirty) {
+    begin_op();
+    iupdate(ip);
+    end_op();
+  }
+  seq = datasync ? ip->dseq : ip->mseq;
+  iunlock(ip);
+  // the commit writes back the other files' data too, since
+  // their metadata may share the transaction.
+  log_sync(seq);
+  return 0;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int fileread(struct file *f, uint64 addr, int n) {
@@ -118,7 +387,11 @@ int fileread(struct file *f, uint64 addr, int n) {
     r = devsw[f->major].read(1, addr, n);
   } else if (f->type == FD_INODE) {
     ilock(f->ip);
-    if ((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if (f->direct && f->off % BSIZE == 0)
+      r = iodirect(f->ip, addr, f->off, n, 0);
+    else
+      r = readi(f->ip, 1, addr, f->off, n);
+    if (r > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
@@ -143,28 +416,30 @@ int filewrite(struct file *f, uint64 addr, int n) {
       return -EINVAL;
     ret = devsw[f->major].write(1, addr, n);
   } else if (f->type == FD_INODE) {
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // file data is not logged, so a chunk's transaction holds
+    // only the i-node, at most three indirect blocks or the
+    // extent overflow block, and the allocation blocks.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+    int max = WRITECHUNK;
     int i = 0;
     while (i < n) {
       int n1 = n - i;
       if (n1 > max)
         n1 = max;
 
-      // begin_op();
+      begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      if (f->direct && f->off % BSIZE == 0)
+        r = iodirect(f->ip, addr + i, f->off, n1, 1);
+      else
+        r = writei(f->ip, 1, addr + i, f->off, n1);
+      if (r > 0)
         f->off += r;
       iunlock(f->ip);
-      // end_op();
+      end_op();
 
       if (r != n1) {
-        printf("%d\n", r);
         // error from writei
         break;
       }
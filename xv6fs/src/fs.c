@@ -9,6 +9,8 @@
 // routines.  The (higher-level) system call implementations
 // are in sysfile.c.
 
+#include <stdlib.h>
+
 #include "defs.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -17,21 +19,23 @@
 // only one device
 struct superblock sb;
 
-#define NINODES 200
+#define NINODES 2048
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE / (BSIZE * 8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
+int nbitmap;      // Number of bitmap blocks
+int ninodeblocks; // Number of inode blocks
 int nlog = LOGSIZE;
 int nmeta;   // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks; // Number of data blocks
-char zeroes[BSIZE];
+char zeroes[MAXBSIZE];
 uint freeinode = 1;
 uint freeblock;
 
 // Read the super block.
+// The block size must already be known, since it decides
+// where block 1 lives on the disk.
 static void readsb(int dev, struct superblock *sb) {
   struct buf *bp;
 
@@ -62,7 +66,7 @@ static void wsect(uint sec, void *buf) { disk_rw(buf, sec, 1); }
 static void rsect(uint sec, void *buf) { disk_rw(buf, sec, 0); }
 
 static void winode(uint inum, struct dinode *ip) {
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -74,7 +78,7 @@ static void winode(uint inum, struct dinode *ip) {
 }
 
 static void rinode(uint inum, struct dinode *ip) {
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -97,7 +101,7 @@ static uint init_ialloc(ushort type) {
 }
 
 static void init_balloc(int used) {
-  uchar buf[BSIZE];
+  uchar buf[MAXBSIZE];
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
@@ -110,13 +114,35 @@ static void init_balloc(int used) {
   wsect(sb.bmapstart, buf);
 }
 
+// Return the block backing fbn of an extent-mapped inode,
+// allocating it after the last inline extent if necessary.
+static uint eappend(struct dinode *din, uint fbn) {
+  struct extent *e = (struct extent *)din->addrs;
+  int i;
+
+  for (i = 0; i < NIEXTENT && xint(e[i].len); i++) {
+    if (fbn >= xint(e[i].lstart) && fbn - xint(e[i].lstart) < xint(e[i].len))
+      return xint(e[i].pstart) + fbn - xint(e[i].lstart);
+  }
+  if (i > 0 && xint(e[i - 1].lstart) + xint(e[i - 1].len) == fbn &&
+      xint(e[i - 1].pstart) + xint(e[i - 1].len) == freeblock) {
+    e[i - 1].len = xint(xint(e[i - 1].len) + 1);
+    return freeblock++;
+  }
+  assert(i < NIEXTENT);
+  e[i].lstart = xint(fbn);
+  e[i].pstart = xint(freeblock);
+  e[i].len = xint(1);
+  return freeblock++;
+}
+
 // we only care about indirect blocks here
 static void iappend(uint inum, void *xp, int n) {
   char *p = (char *)xp;
   uint fbn, off, n1;
   struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  char buf[MAXBSIZE];
+  uint indirect[MAXBSIZE / sizeof(uint)];
   uint x;
 
   rinode(inum, &din);
@@ -125,7 +151,9 @@ static void iappend(uint inum, void *xp, int n) {
   while (n > 0) {
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if (fbn < NDIRECT) {
+    if (sb.flags & SB_EXTENTS) {
+      x = eappend(&din, fbn);
+    } else if (fbn < NDIRECT) {
       if (xint(din.addrs[fbn]) == 0) {
         din.addrs[fbn] = xint(freeblock++);
       }
@@ -157,9 +185,23 @@ static void create_image(void) {
   int i, cc, fd;
   uint rootino, inum, off;
   struct dirent de;
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   struct dinode din;
 
+  // the block size is fixed at format time and recorded in the
+  // super block; everything below is laid out in units of it.
+  if (FSBSIZE < 1024 || FSBSIZE > MAXBSIZE || (FSBSIZE & (FSBSIZE - 1)))
+    panic("mkfs: bad block size");
+  // a block travels to the ramdisk behind the request header.
+  if (FSBSIZE > DISKBUF - DISKHDR)
+    panic("mkfs: block size does not fit the disk buffer");
+  sb.bsize = xint(FSBSIZE);
+  sb.flags = xint(FSEXTENTS ? SB_EXTENTS : 0);
+  disk_init(BSIZE);
+
+  nbitmap = FSSIZE / (BSIZE * 8) + 1;
+  ninodeblocks = NINODES / IPB + 1;
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -210,6 +252,9 @@ static void create_image(void) {
   init_balloc(freeblock);
 }
 
+static void bindexinit(int);
+static void iindexinit(int);
+
 // Init fs
 void fsinit(int dev) {
   create_image();
@@ -217,48 +262,208 @@ void fsinit(int dev) {
   readsb(dev, &sb);
   if (sb.magic != FSMAGIC)
     panic("invalid file system");
-  //   initlog(dev, &sb);
+  initlog(dev, &sb);
+
+  // keep inode and bitmap blocks resident; they end where
+  // the data blocks begin.
+  bmetainit(dev, sb.inodestart, sb.size - sb.nblocks - sb.inodestart);
+  bzeroinit(sb.size);
+  bindexinit(dev);
+  iindexinit(dev);
 }
 
-// Zero a block.
-static void zero_block(int dev, int bno) {
+// Blocks.
+//
+// The free bitmap is searched a 64-bit word at a time: bit i of
+// bitmap word w is block 64 * w + i (the bitmap's byte order on a
+// little-endian machine). bindex keeps one summary bit per bitmap
+// word, set when the word has no free block, so runs of full words
+// are skipped 64 at a time. The search is next-fit from the word
+// where the previous allocation ended, and bfree keeps the summary
+// consistent with the on-disk bitmap.
+//
+// File data is written in place, not through the log, so a block
+// freed in the open transaction must not be handed out again until
+// that transaction commits: a new owner's data could reach the disk
+// first, and after a crash the old file would read it. bfree holds
+// such blocks in bindex.held, and bheldrelease makes them free once
+// the log has committed. begin_op commits early when free blocks
+// run low and the commit would free more (see bfreewaiting).
+//
+// Blocks are handed out in contiguous runs: ballocrun reserves the
+// first free block at or after a goal plus the free blocks that
+// follow it. A growing file keeps a run reserved ahead of it (see
+// balloc), so files that grow side by side, like a database and
+// its WAL, do not interleave. Reservations live in bindex.resv
+// only; bclaim marks a block in the on-disk bitmap when it is
+// handed out, so a crash cannot leak a reserved block.
+
+#define WPB (BSIZE / sizeof(uint64)) // Bitmap words per block
+
+static struct {
+  uint64 *full; // one bit per bitmap word: word has no free block
+  uint nwords;  // bitmap words covering sb.size blocks
+  uint cursor;  // bitmap word the next search starts at
+  uint64 *held; // per bitmap word: blocks freed since the last commit
+  uint64 *resv; // per bitmap word: blocks reserved ahead of a file
+  uint nheld;
+  uint nfree;   // blocks that may be allocated
+  uint dev;
+} bindex;
+
+// Mask of the bits in bitmap word w that name real blocks.
+static uint64 bwordmask(uint w) {
+  if ((w + 1) * 64 <= sb.size)
+    return ~0UL;
+  return (1UL << (sb.size - w * 64)) - 1;
+}
+
+// Return the free blocks in bitmap word w that may be allocated,
+// as a bit mask.
+static uint64 bwordfree(uint dev, uint w) {
   struct buf *bp;
+  uint64 free;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
-  //   log_write(bp);
+  bp = bread(dev, sb.bmapstart + w / WPB);
+  free = ~*((uint64 *)bp->data + w % WPB) & bwordmask(w);
+  free &= ~(bindex.held[w] | bindex.resv[w]);
   brelse(bp);
+  return free;
 }
 
-// Blocks.
+// Record in the summary whether bitmap word w has a free block.
+static void bsummary(uint dev, uint w) {
+  if (bwordfree(dev, w) == 0)
+    bindex.full[w / 64] |= 1UL << (w % 64);
+  else
+    bindex.full[w / 64] &= ~(1UL << (w % 64));
+}
 
-// Allocate a zeroed disk block.
+// Build the free-space index from the on-disk bitmap.
+static void bindexinit(int dev) {
+  uint w, nsum;
+
+  bindex.nwords = (sb.size + 63) / 64;
+  nsum = (bindex.nwords + 63) / 64;
+  bindex.full = calloc(nsum, sizeof(uint64));
+  bindex.held = calloc(bindex.nwords, sizeof(uint64));
+  bindex.resv = calloc(bindex.nwords, sizeof(uint64));
+  if (bindex.full == 0 || bindex.held == 0 || bindex.resv == 0)
+    panic("bindexinit");
+  bindex.dev = dev;
+  // summary bits past the last word never have a free block.
+  for (w = bindex.nwords; w < nsum * 64; w++)
+    bindex.full[w / 64] |= 1UL << (w % 64);
+  bindex.nfree = 0;
+  for (w = 0; w < bindex.nwords; w++) {
+    bsummary(dev, w);
+    bindex.nfree += __builtin_popcountl(bwordfree(dev, w));
+  }
+  bindex.cursor = 0;
+}
+
+// Return the first bitmap word at or after word start (wrapping
+// around) that has a free block, or bindex.nwords if there is none.
+static uint bfindword(uint start) {
+  uint i, s, nsum;
+  uint64 first, f;
+
+  nsum = (bindex.nwords + 63) / 64;
+  s = start / 64;
+  first = ~0UL << (start % 64);
+  for (i = 0; i <= nsum; i++, s = (s + 1) % nsum) {
+    f = ~bindex.full[s];
+    if (i == 0)
+      f &= first;
+    else if (i == nsum)
+      f &= ~first;
+    if (f)
+      return s * 64 + __builtin_ctzl(f);
+  }
+  return bindex.nwords;
+}
+
+// Reserve up to want contiguous blocks, starting with the first
+// free block at or after goal, and set *got to how many were
+// reserved. Nothing is written: bclaim allocates each block as it
+// is used, and bunreserve gives back the rest.
 // returns 0 if out of disk space.
-static uint balloc(uint dev) {
-  int b, bi, m;
+static uint ballocrun(uint dev, uint goal, uint want, uint *got) {
+  uint w, b, n;
+  uint64 free;
+
+  *got = 0;
+  if (goal >= sb.size)
+    goal = 0;
+  w = goal / 64;
+  free = bwordfree(dev, w) & (~0UL << (goal % 64));
+  if (free == 0) {
+    if ((w = bfindword((w + 1) % bindex.nwords)) == bindex.nwords) {
+      // truncated files may still hold blocks; free them first.
+      if (ireclaim(sb.size) > 0)
+        return ballocrun(dev, goal, want, got);
+      printf("balloc: out of blocks\n");
+      return 0;
+    }
+    if ((free = bwordfree(dev, w)) == 0)
+      panic("balloc: index out of sync");
+  }
+  b = w * 64 + __builtin_ctzl(free);
+
+  // Reserve b and as many of the free blocks after it as wanted.
+  for (n = 0; n < want && b + n < sb.size; n++) {
+    w = (b + n) / 64;
+    if ((bwordfree(dev, w) >> ((b + n) % 64) & 1) == 0)
+      break;
+    bindex.resv[w] |= 1UL << ((b + n) % 64);
+    bsummary(dev, w);
+  }
+  bindex.cursor = (b + n - 1) / 64;
+  bindex.nfree -= n;
+  *got = n;
+  return b;
+}
+
+// Allocate reserved block b: mark it in use in the on-disk bitmap.
+static void bclaim(uint dev, uint b) {
   struct buf *bp;
+  uint w = b / 64;
 
-  bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
-    bp = bread(dev, BBLOCK(b, sb));
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-      m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) { // Is block free?
-        bp->data[bi / 8] |= m;           // Mark block in use.
-        // log_write(bp);
-        brelse(bp);
-        zero_block(dev, b + bi);
-        return b + bi;
-      }
-    }
-    brelse(bp);
+  bp = bread(dev, BBLOCK(b, sb));
+  *((uint64 *)bp->data + w % WPB) |= 1UL << (b % 64);
+  log_write(bp);
+  brelse(bp);
+  bindex.resv[w] &= ~(1UL << (b % 64));
+}
+
+// Allocate a zeroed disk block for ip, right after the last one
+// it was given. Regular files draw from a run of up to NRESERVE
+// blocks reserved ahead of them; bunreserve gives back what is
+// left when the file is truncated or no longer referenced.
+// returns 0 if out of disk space.
+static uint balloc(struct inode *ip) {
+  uint b, n, goal;
+
+  if (ip->nresv == 0) {
+    goal = ip->goal ? ip->goal : bindex.cursor * 64;
+    b = ballocrun(ip->dev, goal, ip->type == T_FILE ? NRESERVE : 1, &n);
+    if (b == 0)
+      return 0;
+    ip->resv = b;
+    ip->nresv = n;
   }
-  printf("balloc: out of blocks\n");
-  return 0;
+  b = ip->resv++;
+  ip->nresv--;
+  ip->goal = b + 1;
+  bclaim(ip->dev, b);
+  bmarkzero(ip->dev, b);
+  return b;
 }
 
-// Free a disk block.
-static void bfree(int dev, uint b) {
+// Free a disk block. With hold, the block may still be reached
+// through a committed inode, so it is not allocated again until
+// the open transaction commits.
+static void bfree(int dev, uint b, int hold) {
   struct buf *bp;
   int bi, m;
 
@@ -268,8 +473,210 @@ static void bfree(int dev, uint b) {
   if ((bp->data[bi / 8] & m) == 0)
     panic("freeing free block");
   bp->data[bi / 8] &= ~m;
-  //   log_write(bp);
+  log_write(bp);
   brelse(bp);
+  if (hold) {
+    bindex.held[b / 64] |= 1UL << (b % 64);
+    bindex.nheld++;
+  } else {
+    bindex.full[b / 64 / 64] &= ~(1UL << (b / 64 % 64));
+    bindex.nfree++;
+  }
+}
+
+// The blocks freed in the transaction just committed may now be
+// allocated again. Called by the log after each commit.
+void bheldrelease(void) {
+  uint w;
+
+  for (w = 0; w < bindex.nwords && bindex.nheld > 0; w++) {
+    if (bindex.held[w]) {
+      bindex.nheld -= __builtin_popcountl(bindex.held[w]);
+      bindex.nfree += __builtin_popcountl(bindex.held[w]);
+      bindex.held[w] = 0;
+      bsummary(bindex.dev, w);
+    }
+  }
+}
+
+// Give back the blocks reserved ahead of ip.
+static void bunreserve(struct inode *ip) {
+  uint b;
+
+  while (ip->nresv > 0) {
+    ip->nresv--;
+    b = ip->resv + ip->nresv;
+    bindex.resv[b / 64] &= ~(1UL << (b % 64));
+    bindex.full[b / 64 / 64] &= ~(1UL << (b / 64 % 64));
+    bindex.nfree++;
+  }
+}
+
+// Reclaiming truncated files.
+//
+// itrunc frees the first NRECLAIM blocks of a file itself and
+// queues the rest of its block map here. The server calls ireclaim
+// between requests to free a bounded number of blocks at a time,
+// and ballocrun drains the queue before it reports the disk full.
+// Progress is kept in the queue entry, so the detached indirect
+// and extent blocks are only read, and a slice logs nothing but
+// bitmap blocks. An entry waits until the transaction that
+// detached its map has committed: until then the old inode on
+// disk still points at the blocks, so they must not be reused.
+// The queue lives only in memory, so blocks still queued at a
+// crash stay marked in use on disk.
+
+struct reclaim {
+  uint dev;
+  uint seq;                // transaction that detached the map
+  uint addrs[NDIRECT + 2]; // detached copy of ip->addrs
+  uint pos;                // next logical block, or overflow extent
+  uint sub;                // blocks freed of that extent
+  struct reclaim *next;
+};
+
+static struct {
+  struct reclaim *head;
+  struct reclaim *tail;
+} reclaimq;
+
+// Free the tree under *slot, which maps the logical blocks from
+// base on through depth levels of indirect blocks, starting at
+// logical block *pos and spending at most *budget block frees.
+// Advances *pos, and frees and clears *slot once its blocks are
+// gone. Returns 0 if the budget ran out first.
+static int rfree(struct reclaim *r, uint *slot, uint base, int depth,
+                 uint *pos, int *budget) {
+  struct buf *bp;
+  uint *a, span, end, i, b;
+  int done;
+
+  span = depth > 1 ? NINDIRECT : 1;
+  end = base + span * NINDIRECT;
+  if (*slot == 0) {
+    if (*pos < end)
+      *pos = end;
+    return 1;
+  }
+  bp = bread(r->dev, *slot);
+  a = (uint *)bp->data;
+  done = 1;
+  while (*pos < end && done) {
+    i = (*pos - base) / span;
+    b = a[i];
+    if (depth > 1) {
+      done = rfree(r, &b, base + i * span, depth - 1, pos, budget);
+    } else if (b == 0) {
+      (*pos)++;
+    } else if (*budget > 0) {
+      bfree(r->dev, b, r->seq == log_seq());
+      (*budget)--;
+      (*pos)++;
+    } else {
+      done = 0;
+    }
+  }
+  brelse(bp);
+  if (!done)
+    return 0;
+  // *pos has moved past the tree, so its indirect block goes now
+  // even if that overdraws the budget.
+  bfree(r->dev, *slot, r->seq == log_seq());
+  *slot = 0;
+  (*budget)--;
+  return 1;
+}
+
+// Free the blocks of extent e from its start, at most *budget.
+static int efree(struct reclaim *r, struct extent *e, int *budget) {
+  while (e->len > 0) {
+    if (*budget <= 0)
+      return 0;
+    bfree(r->dev, e->pstart, r->seq == log_seq());
+    e->pstart++;
+    e->len--;
+    (*budget)--;
+  }
+  return 1;
+}
+
+// Free what is left of the block map in r, at most *budget
+// blocks. Returns 1 once all of it is freed.
+static int rfreemap(struct reclaim *r, int *budget) {
+  struct extent *e = (struct extent *)r->addrs;
+  struct extblock *xb;
+  struct buf *bp;
+  int i;
+
+  if (sb.flags & SB_EXTENTS) {
+    for (i = 0; i < NIEXTENT; i++) {
+      if (!efree(r, &e[i], budget))
+        return 0;
+    }
+    if (r->addrs[EXTOVERFLOW] == 0)
+      return 1;
+    bp = bread(r->dev, r->addrs[EXTOVERFLOW]);
+    xb = (struct extblock *)bp->data;
+    for (; r->pos < xb->n; r->pos++, r->sub = 0) {
+      for (; r->sub < xb->e[r->pos].len; r->sub++) {
+        if (*budget <= 0) {
+          brelse(bp);
+          return 0;
+        }
+        bfree(r->dev, xb->e[r->pos].pstart + r->sub,
+              r->seq == log_seq());
+        (*budget)--;
+      }
+    }
+    brelse(bp);
+    bfree(r->dev, r->addrs[EXTOVERFLOW], r->seq == log_seq());
+    r->addrs[EXTOVERFLOW] = 0;
+    (*budget)--;
+    return 1;
+  }
+
+  for (; r->pos < NDIRECT; r->pos++) {
+    if (r->addrs[r->pos]) {
+      if (*budget <= 0)
+        return 0;
+      bfree(r->dev, r->addrs[r->pos], r->seq == log_seq());
+      r->addrs[r->pos] = 0;
+      (*budget)--;
+    }
+  }
+  return rfree(r, &r->addrs[NDIRECT], NDIRECT, 1, &r->pos, budget) &&
+         rfree(r, &r->addrs[NDIRECT + 1], NDIRECT + NINDIRECT, 2, &r->pos,
+               budget);
+}
+
+// Free up to n blocks of truncated files.
+// Returns the number of blocks freed.
+int ireclaim(int n) {
+  struct reclaim *r;
+  int budget = n;
+
+  while ((r = reclaimq.head) != 0 && r->seq != log_seq() && budget > 0) {
+    if (!rfreemap(r, &budget))
+      break;
+    reclaimq.head = r->next;
+    free(r);
+  }
+  return n - budget;
+}
+
+// Whether a truncated file still has blocks that ireclaim can free.
+int ireclaimable(void) {
+  return reclaimq.head != 0 && reclaimq.head->seq != log_seq();
+}
+
+// Whether free blocks are running low and committing the open
+// transaction would give more: blocks it freed, or truncated
+// files it detached.
+int bfreewaiting(void) {
+  if (bindex.nfree >= sb.size / NFREELOW)
+    return 0;
+  return bindex.nheld > 0 ||
+         (reclaimq.head != 0 && reclaimq.tail->seq == log_seq());
 }
 
 // Inodes.
@@ -297,18 +704,20 @@ static void bfree(int dev, uint b) {
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref has fallen to zero stays in the
+//   table, still valid, on an LRU list, so that the next
+//   iget() of the same inode needs no disk access; it is
+//   recycled only once the table has NINODE entries.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -332,6 +741,11 @@ static void bfree(int dev, uint b) {
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// The table is a hash on (dev, inum) over entries allocated
+// NICHUNK at a time. It grows past NINODE rather than fail
+// when every entry is referenced; entries never move, so
+// inode pointers stay valid.
+//
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
@@ -341,14 +755,28 @@ static void bfree(int dev, uint b) {
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 128 // inode table hash buckets
+#define NICHUNK 32 // inode table entries allocated at a time
+
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   //   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+
+  // Unreferenced valid inodes, through prev/next.
+  // lru.next is most recently used, lru.prev is least.
+  struct inode lru;
+
+  struct inode *free; // unused entries, through next
+  int n;              // entries allocated
 } itable;
 
 void iinit() {
   //   int i = 0;
 
+  itable.lru.prev = &itable.lru;
+  itable.lru.next = &itable.lru;
   //   initlock(&itable.lock, "itable");
   //   for (i = 0; i < NINODE; i++) {
   //     initsleeplock(&itable.inode[i].lock, "inode");
@@ -356,27 +784,65 @@ void iinit() {
 }
 
 static struct inode *iget(uint dev, uint inum);
+static void dcachepurge(struct inode *);
+
+// Free inodes are found through an in-memory bitmap, one bit per
+// inum, set while the inode's on-disk type is 0. iindexinit builds
+// it from the inode blocks at boot; ialloc clears a bit and iput
+// sets it again when it frees the inode.
+
+static struct {
+  uint64 *free; // bit inum: inode is free
+  uint nwords;  // words covering sb.ninodes inums
+  uint cursor;  // word the next search starts at
+} iindex;
+
+static void iindexinit(int dev) {
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  iindex.nwords = (sb.ninodes + 63) / 64;
+  iindex.free = calloc(iindex.nwords, sizeof(uint64));
+  if (iindex.free == 0)
+    panic("iindexinit");
+  // inum 0 is never allocated.
+  for (inum = 1; inum < sb.ninodes; inum++) {
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode *)bp->data + inum % IPB;
+    if (dip->type == 0)
+      iindex.free[inum / 64] |= 1UL << (inum % 64);
+    brelse(bp);
+  }
+  iindex.cursor = 0;
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode *ialloc(uint dev, short type) {
-  int inum;
+  uint i, w, inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for (inum = 1; inum < sb.ninodes; inum++) {
+  for (i = 0; i < iindex.nwords; i++) {
+    w = (iindex.cursor + i) % iindex.nwords;
+    if (iindex.free[w] == 0)
+      continue;
+    inum = w * 64 + __builtin_ctzl(iindex.free[w]);
+    iindex.free[w] &= ~(1UL << (inum % 64));
+    iindex.cursor = w;
+
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode *)bp->data + inum % IPB;
-    if (dip->type == 0) { // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      //   log_write(bp); // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
+    if (dip->type != 0)
+      panic("ialloc: inode in use");
+    memset(dip, 0, sizeof(*dip));
+    dip->type = type;
+    log_write(bp); // mark it allocated on the disk
     brelse(bp);
+    return iget(dev, inum);
   }
   printf("ialloc: no inodes\n");
   return 0;
@@ -384,7 +850,8 @@ struct inode *ialloc(uint dev, short type) {
 
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
-// that lives on disk.
+// that lives on disk, except that writei only sets ip->dirty
+// when it grows the file, and the last iput writes it back.
 // Caller must hold ip->lock.
 void iupdate(struct inode *ip) {
   struct buf *bp;
@@ -396,41 +863,105 @@ void iupdate(struct inode *ip) {
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
+  // fdatasync must wait for a size or block map change, whether
+  // or not the caller set ip->dirty for it.
+  if (dip->size != ip->size ||
+      memcmp(dip->addrs, ip->addrs, sizeof(ip->addrs)) != 0)
+    ip->dirty = 1;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  //   log_write(bp);
+  log_write(bp);
   brelse(bp);
+  ip->mseq = log_seq();
+  if (ip->dirty)
+    ip->dseq = ip->mseq;
+  ip->dirty = 0;
+}
+
+// log_write a block that holds part of ip's contents or block
+// map, and note it for fsync and fdatasync.
+static void ilogwrite(struct inode *ip, struct buf *bp) {
+  log_write(bp);
+  ip->mseq = ip->dseq = log_seq();
+}
+
+// Add NICHUNK unused entries to the inode table.
+static void igrow(void) {
+  struct inode *ip, *chunk;
+
+  if ((chunk = calloc(NICHUNK, sizeof(struct inode))) == 0)
+    panic("iget: no inodes");
+  for (ip = chunk; ip < chunk + NICHUNK; ip++) {
+    ip->next = itable.free;
+    itable.free = ip;
+  }
+  itable.n += NICHUNK;
+}
+
+static void ilruremove(struct inode *ip) {
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+static void ihashremove(struct inode *ip) {
+  struct inode **pp;
+
+  pp = &itable.hash[IHASH(ip->dev, ip->inum)];
+  for (; *pp; pp = &(*pp)->hnext) {
+    if (*pp == ip) {
+      *pp = ip->hnext;
+      return;
+    }
+  }
 }
 
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode *iget(uint dev, uint inum) {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   //   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for (ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-      ip->ref++;
+  for (ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext) {
+    if (ip->dev == dev && ip->inum == inum) {
+      if (ip->ref++ == 0)
+        ilruremove(ip);
       //   release(&itable.lock);
       return ip;
     }
-    if (empty == 0 && ip->ref == 0) // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if (empty == 0)
-    panic("iget: no inodes");
+  // Take an unused entry, growing the table while it is below
+  // NINODE entries or when every entry is referenced; otherwise
+  // recycle the least recently used unreferenced inode.
+  if (itable.free == 0 &&
+      (itable.n < NINODE || itable.lru.prev == &itable.lru))
+    igrow();
+  if (itable.free) {
+    ip = itable.free;
+    itable.free = ip->next;
+  } else {
+    ip = itable.lru.prev;
+    ilruremove(ip);
+    ihashremove(ip);
+  }
+  ip->hnext = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->dirty = 0;
+  // changes made before ip was last evicted may still be in the
+  // open transaction.
+  ip->mseq = ip->dseq = log_seq();
+  ip->nmap = 0;
+  ip->goal = 0;
+  ip->nresv = 0;
+  memset(ip->bmc, 0, sizeof(ip->bmc));
   //   release(&itable.lock);
 
   return ip;
@@ -482,7 +1013,7 @@ void iunlock(struct inode *ip) {
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled; a valid one is kept on the LRU list until then.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -499,17 +1030,38 @@ void iput(struct inode *ip) {
 
     // release(&itable.lock);
 
+    if (ip->type == T_DIR)
+      dcachepurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    iindex.free[ip->inum / 64] |= 1UL << (ip->inum % 64);
 
     // releasesleep(&ip->lock);
 
     // acquire(&itable.lock);
   }
 
+  if (ip->ref == 1) {
+    // write back the size and block map that writei deferred.
+    if (ip->valid && ip->dirty)
+      iupdate(ip);
+    bunreserve(ip);
+  }
   ip->ref--;
+  if (ip->ref == 0) {
+    if (ip->valid) {
+      ip->next = itable.lru.next;
+      ip->prev = &itable.lru;
+      itable.lru.next->prev = ip;
+      itable.lru.next = ip;
+    } else {
+      ihashremove(ip);
+      ip->next = itable.free;
+      itable.free = ip;
+    }
+  }
   //   release(&itable.lock);
 }
 
@@ -521,25 +1073,162 @@ void iunlockput(struct inode *ip) {
 
 // Inode content
 //
+// Extent-mapped inodes (SB_EXTENTS) keep their extents, sorted by
+// logical block, in addrs[] and an overflow block; see defs.h.
+// emap looks a block up with one pass over the inline extents,
+// reading the overflow block only for files with more than
+// NIEXTENT extents. A newly allocated block that continues an
+// extent both logically and physically just lengthens it.
+
+// Scratch space for a file's full extent list.
+static struct extent ext[NIEXTENT + MAXBSIZE / sizeof(struct extent)];
+
+// Copy ip's extents, inline then overflow, into ext[].
+// Returns the number of extents.
+static int eload(struct inode *ip) {
+  struct extent *e = (struct extent *)ip->addrs;
+  struct extblock *xb;
+  struct buf *bp;
+  int n;
+
+  for (n = 0; n < NIEXTENT && e[n].len; n++)
+    ext[n] = e[n];
+  if (n == NIEXTENT && ip->addrs[EXTOVERFLOW]) {
+    bp = bread(ip->dev, ip->addrs[EXTOVERFLOW]);
+    xb = (struct extblock *)bp->data;
+    memmove(ext + n, xb->e, xb->n * sizeof(struct extent));
+    n += xb->n;
+    brelse(bp);
+  }
+  return n;
+}
+
+// Store the n extents in ext[] back into ip, spilling the ones
+// that do not fit inline into the overflow block.
+// Returns -1 if they do not fit or the disk is full.
+static int estore(struct inode *ip, int n) {
+  struct extent *e = (struct extent *)ip->addrs;
+  struct extblock *xb;
+  struct buf *bp;
+  uint b, got;
+  int i;
+
+  if (n > NIEXTENT + NXEXTENT)
+    return -1;
+  if (n > NIEXTENT && ip->addrs[EXTOVERFLOW] == 0) {
+    if ((b = ballocrun(ip->dev, bindex.cursor * 64, 1, &got)) == 0)
+      return -1;
+    bclaim(ip->dev, b);
+    ip->addrs[EXTOVERFLOW] = b;
+  }
+  for (i = 0; i < NIEXTENT; i++) {
+    if (i < n)
+      e[i] = ext[i];
+    else
+      memset(&e[i], 0, sizeof(e[i]));
+  }
+  ip->dirty = 1;
+  if (ip->addrs[EXTOVERFLOW]) {
+    bp = bread(ip->dev, ip->addrs[EXTOVERFLOW]);
+    xb = (struct extblock *)bp->data;
+    xb->n = n > NIEXTENT ? n - NIEXTENT : 0;
+    memmove(xb->e, ext + NIEXTENT, xb->n * sizeof(struct extent));
+    ilogwrite(ip, bp);
+    brelse(bp);
+  }
+  return 0;
+}
+
+// bmap for extent-mapped inodes. Sets *len to the number of
+// blocks from bn on that follow it physically. Allocates an
+// unmapped block only if alloc is set.
+static uint emap(struct inode *ip, uint bn, uint *len, int alloc) {
+  struct extent *e = (struct extent *)ip->addrs;
+  uint addr;
+  int i, n;
+
+  for (i = 0; i < NIEXTENT && e[i].len; i++) {
+    if (bn >= e[i].lstart && bn - e[i].lstart < e[i].len) {
+      *len = e[i].len - (bn - e[i].lstart);
+      return e[i].pstart + bn - e[i].lstart;
+    }
+  }
+  n = eload(ip);
+  for (i = NIEXTENT; i < n; i++) {
+    if (bn >= ext[i].lstart && bn - ext[i].lstart < ext[i].len) {
+      *len = ext[i].len - (bn - ext[i].lstart);
+      return ext[i].pstart + bn - ext[i].lstart;
+    }
+  }
+
+  // Not mapped: allocate a block and record it.
+  if (!alloc || (addr = balloc(ip)) == 0)
+    return 0;
+  *len = 1;
+  n = eload(ip);
+  for (i = 0; i < n && ext[i].lstart < bn; i++)
+    ;
+  if (i > 0 && ext[i - 1].lstart + ext[i - 1].len == bn &&
+      ext[i - 1].pstart + ext[i - 1].len == addr) {
+    ext[i - 1].len++;
+    if (i < n && ext[i].lstart == bn + 1 && ext[i].pstart == addr + 1) {
+      // bn closed the gap between two extents.
+      ext[i - 1].len += ext[i].len;
+      memmove(&ext[i], &ext[i + 1], (n - i - 1) * sizeof(ext[0]));
+      n--;
+    }
+  } else if (i < n && ext[i].lstart == bn + 1 && ext[i].pstart == addr + 1) {
+    ext[i].lstart--;
+    ext[i].pstart--;
+    ext[i].len++;
+  } else {
+    memmove(&ext[i + 1], &ext[i], (n - i) * sizeof(ext[0]));
+    ext[i].lstart = bn;
+    ext[i].pstart = addr;
+    ext[i].len = 1;
+    n++;
+  }
+  if (estore(ip, n) < 0) {
+    bfree(ip->dev, addr, 0);
+    return 0;
+  }
+  return addr;
+}
+
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
-static uint bmap(struct inode *ip, uint bn) {
+// Count the entries of a[i..n) that continue the physical
+// run starting at a[i].
+static uint runlen(uint *a, uint i, uint n) {
+  uint len;
+
+  for (len = 1; i + len < n && a[i + len] == a[i] + len; len++)
+    ;
+  return len;
+}
+
+// bmap for inodes with direct and indirect blocks. Sets *len
+// to the number of blocks from bn on that follow it physically
+// within the same block-number array. Allocates missing blocks,
+// indirect ones included, only if alloc is set.
+static uint bmapind(struct inode *ip, uint bn, uint *len, int alloc) {
   uint addr, *a, *indirect, *indirect2;
   struct buf *bp, *bp2;
 
   if (bn < NDIRECT) {
     if ((addr = ip->addrs[bn]) == 0) {
-      addr = balloc(ip->dev);
+      if (!alloc)
+        return 0;
+      addr = balloc(ip);
       if (addr == 0)
         return 0;
       ip->addrs[bn] = addr;
+      ip->dirty = 1;
     }
+    *len = runlen(ip->addrs, bn, NDIRECT);
     return addr;
   }
   bn -= NDIRECT;
@@ -547,20 +1236,25 @@ static uint bmap(struct inode *ip, uint bn) {
   if (bn < NINDIRECT) {
     // Load indirect block, allocating if necessary.
     if ((addr = ip->addrs[NDIRECT]) == 0) {
-      addr = balloc(ip->dev);
+      if (!alloc)
+        return 0;
+      addr = balloc(ip);
       if (addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
+      ip->dirty = 1;
     }
     bp = bread(ip->dev, addr);
     a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      addr = balloc(ip->dev);
+    if ((addr = a[bn]) == 0 && alloc) {
+      addr = balloc(ip);
       if (addr) {
         a[bn] = addr;
-        // log_write(bp);
+        ilogwrite(ip, bp);
       }
     }
+    if (addr)
+      *len = runlen(a, bn, NINDIRECT);
     brelse(bp);
     return addr;
   }
@@ -568,32 +1262,40 @@ static uint bmap(struct inode *ip, uint bn) {
 
   if (bn < NINDIRECT2) {
     if ((addr = ip->addrs[NDIRECT + 1]) == 0) {
-      addr = balloc(ip->dev);
+      if (!alloc)
+        return 0;
+      addr = balloc(ip);
       if (addr == 0)
         return 0;
       ip->addrs[NDIRECT + 1] = addr;
+      ip->dirty = 1;
     }
     bp = bread(ip->dev, addr);
     indirect = (uint *)bp->data;
     if ((addr = indirect[bn / NINDIRECT]) == 0) {
-      addr = balloc(ip->dev);
+      if (alloc)
+        addr = balloc(ip);
       if (addr == 0) {
         brelse(bp);
         return 0;
       }
       indirect[bn / NINDIRECT] = addr;
+      ilogwrite(ip, bp);
     }
     bp2 = bread(ip->dev, addr);
     indirect2 = (uint *)bp2->data;
     if ((addr = indirect2[bn % NINDIRECT]) == 0) {
-      addr = balloc(ip->dev);
+      if (alloc)
+        addr = balloc(ip);
       if (addr == 0) {
         brelse(bp2);
         brelse(bp);
         return 0;
       }
       indirect2[bn % NINDIRECT] = addr;
+      ilogwrite(ip, bp2);
     }
+    *len = runlen(indirect2, bn % NINDIRECT, NINDIRECT);
     brelse(bp2);
     brelse(bp);
     return addr;
@@ -602,53 +1304,136 @@ static uint bmap(struct inode *ip, uint bn) {
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void itrunc(struct inode *ip) {
-  int i, j;
-  struct buf *bp, *bp2;
-  uint *a, *indirect, *indirect2;
+// Per-inode block-map cache.
+//
+// ip->bmc[] remembers runs of logical blocks that map to
+// consecutive physical blocks, so that bmap can usually skip
+// the indirect blocks (or the extent overflow block). The block
+// of an existing mapping only changes when the file is truncated,
+// so itrunc and iget empty the cache; a newly allocated block
+// lengthens the run it continues.
+
+static uint bmcget(struct inode *ip, uint bn) {
+  struct extent *r;
+
+  for (r = ip->bmc; r < ip->bmc + NBMCACHE; r++) {
+    if (r->len && bn >= r->lstart && bn - r->lstart < r->len)
+      return r->pstart + bn - r->lstart;
+  }
+  return 0;
+}
+
+static void bmcput(struct inode *ip, uint bn, uint addr, uint len) {
+  struct extent *r;
 
-  for (i = 0; i < NDIRECT; i++) {
-    if (ip->addrs[i]) {
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+  for (r = ip->bmc; r < ip->bmc + NBMCACHE; r++) {
+    if (r->len && r->lstart + r->len == bn && r->pstart + r->len == addr) {
+      r->len += len;
+      return;
     }
   }
+  r = &ip->bmc[ip->bmcnext++ % NBMCACHE];
+  r->lstart = bn;
+  r->pstart = addr;
+  r->len = len;
+}
 
-  if (ip->addrs[NDIRECT]) {
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint *)bp->data;
-    for (j = 0; j < NINDIRECT; j++) {
-      if (a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+static uint bmapx(struct inode *ip, uint bn, int alloc) {
+  uint addr, len;
+
+  if ((addr = bmcget(ip, bn)) != 0)
+    return addr;
+  if (sb.flags & SB_EXTENTS)
+    addr = emap(ip, bn, &len, alloc);
+  else
+    addr = bmapind(ip, bn, &len, alloc);
+  if (addr)
+    bmcput(ip, bn, addr, len);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+// returns 0 if out of disk space.
+static uint bmap(struct inode *ip, uint bn) { return bmapx(ip, bn, 1); }
+
+// Like bmap, for readers: returns 0 for a block the file does
+// not have (a hole), and never allocates or changes anything.
+static uint bmapget(struct inode *ip, uint bn) { return bmapx(ip, bn, 0); }
+
+// Allocate the blocks backing [off, off + len) of ip, reserving
+// them as one contiguous run where the free space allows, and
+// extend the file to cover the range.
+// Caller must hold ip->lock.
+// Returns 0, or -1 if out of disk space or past MAXFILE.
+int iallocate(struct inode *ip, uint off, uint len) {
+  uint bn, first, last, want, b, n;
+
+  if (off + len < off || off + len > MAXFILESIZE)
+    return -1;
+  if (len == 0)
+    return 0;
+  first = off / BSIZE;
+  last = (off + len - 1) / BSIZE;
+  // leave room in the run for the indirect blocks bmap adds.
+  want = last - first + 1 + (last - first) / NINDIRECT + 2;
+  if (ip->nresv < want) {
+    bunreserve(ip);
+    if ((b = ballocrun(ip->dev, ip->goal ? ip->goal : bindex.cursor * 64,
+                       want, &n)) == 0)
+      return -1;
+    ip->resv = b;
+    ip->nresv = n;
   }
+  for (bn = first; bn <= last; bn++) {
+    if (bmap(ip, bn) == 0)
+      return -1;
+  }
+  if (off + len > ip->size)
+    ip->size = off + len;
+  iupdate(ip);
+  return 0;
+}
 
-  if (ip->addrs[NDIRECT + 1]) {
-    bp = bread(ip->dev, ip->addrs[NDIRECT + 1]);
-    indirect = (uint *)bp->data;
-    for (i = 0; i < NINDIRECT; i++) {
-      if (indirect[i]) {
-        bp2 = bread(ip->dev, indirect[i]);
-        indirect2 = (uint *)bp2->data;
-        for (j = 0; j < NINDIRECT; j++)
-          if (indirect2[j])
-            bfree(ip->dev, indirect2[j]);
-        brelse(bp2);
-        bfree(ip->dev, indirect[i]);
-      }
+// Truncate inode (discard contents).
+// A file of up to NRECLAIM blocks is freed in the current
+// transaction; what is left of a larger one is handed to the
+// reclaim queue, so the time taken does not depend on the
+// file's size.
+// Caller must hold ip->lock.
+void itrunc(struct inode *ip) {
+  struct reclaim tmp, *r;
+  int n;
+
+  bunreserve(ip);
+  tmp.dev = ip->dev;
+  tmp.seq = log_seq();
+  memmove(tmp.addrs, ip->addrs, sizeof(tmp.addrs));
+  tmp.pos = tmp.sub = 0;
+  tmp.next = 0;
+  n = NRECLAIM;
+  if (!rfreemap(&tmp, &n)) {
+    if ((r = malloc(sizeof(*r))) != 0) {
+      *r = tmp;
+      if (reclaimq.head)
+        reclaimq.tail->next = r;
+      else
+        reclaimq.head = r;
+      reclaimq.tail = r;
+    } else {
+      // no memory to queue it: free the rest now.
+      n = sb.size;
+      rfreemap(&tmp, &n);
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT + 1]);
-    ip->addrs[NDIRECT] = 0;
   }
 
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  memset(ip->bmc, 0, sizeof(ip->bmc));
+  ip->goal = 0;
   ip->size = 0;
   iupdate(ip);
+  if (ip->nmap)
+    mapzero(ip);
 }
 
 // Copy stat information from inode.
@@ -659,6 +1444,7 @@ void stati(struct inode *ip, struct stat *st) {
   st->mode = ip->type << 14;
   st->nlink = ip->nlink;
   st->size = ip->size;
+  st->blksize = BSIZE;
 }
 
 // Read data from inode.
@@ -675,11 +1461,14 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
     n = ip->size - off;
 
   for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-    uint addr = bmap(ip, off / BSIZE);
-    if (addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
+    uint addr = bmapget(ip, off / BSIZE);
     m = min(n - tot, BSIZE - off % BSIZE);
+    // a hole reads as zeros.
+    if (addr == 0) {
+      memset((char *)dst, 0, m);
+      continue;
+    }
+    bp = bread(ip->dev, addr);
     // if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
     //   brelse(bp);
     //   tot = -1;
@@ -705,7 +1494,7 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
   // if (off > ip->size || off + n < off)
   if (off + n < off) // leave data hole if off > size
     return -1;
-  if (off + n > MAXFILE * BSIZE) {
+  if (off + n > MAXFILESIZE) {
     printf("Exceed MAXFILE\n");
     return -1;
   }
@@ -714,41 +1503,330 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
     uint addr = bmap(ip, off / BSIZE);
     if (addr == 0)
       break;
-    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off % BSIZE);
+    // a write of the whole block need not read it first.
+    if (m == BSIZE)
+      bp = boverwrite(ip->dev, addr);
+    else
+      bp = bread(ip->dev, addr);
     // if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
     //   brelse(bp);
     //   break;
     // }
     memmove(bp->data + (off % BSIZE), (char *)src, m);
-    // log_write(bp);
+    // directory contents are metadata; file data is written
+    // back in place before the log commits.
+    if (ip->type == T_DIR)
+      ilogwrite(ip, bp);
+    else
+      bdirty(bp, ip->inum);
     brelse(bp);
   }
 
-  if (off > ip->size)
+  if (ip->nmap && tot > 0)
+    mapupdate(ip, off - tot, (char *)(src - tot), tot);
+
+  if (off > ip->size) {
     ip->size = off;
+    ip->dirty = 1;
+  }
 
-  // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
-  iupdate(ip);
+  // the size and any blocks bmap() added to ip->addrs[] reach the
+  // disk inode when ip is written back (see iput); an overwrite
+  // leaves the inode clean.
 
   return tot;
 }
 
+// readi (write == 0) or writei for O_DIRECT: the whole blocks of
+// the transfer go straight between addr and the disk (see
+// bdirect), in runs of physically consecutive blocks, and only a
+// partial last block goes through the buffer cache.
+// off must be block-aligned. Caller must hold ip->lock.
+int iodirect(struct inode *ip, uint64 addr, uint off, uint n, int write) {
+  uint tot, m, b, run;
+  int r;
+
+  if (off % BSIZE || off + n < off)
+    return -1;
+  if (write && off + n > MAXFILESIZE)
+    return -1;
+  if (!write) {
+    if (off >= ip->size)
+      return 0;
+    if (off + n > ip->size)
+      n = ip->size - off;
+  }
+
+  m = n - n % BSIZE;
+  for (tot = 0; tot < m; tot += run * BSIZE) {
+    run = 1;
+    b = bmapx(ip, (off + tot) / BSIZE, write);
+    if (b == 0 && write)
+      break;
+    if (b == 0) {
+      // a hole reads as zeros.
+      memset((char *)addr + tot, 0, BSIZE);
+      continue;
+    }
+    while (tot + run * BSIZE < m && run < NDISKRUN &&
+           bmapx(ip, (off + tot) / BSIZE + run, write) == b + run)
+      run++;
+    bdirect(ip->dev, b, run, (char *)addr + tot, write);
+  }
+
+  if (write && tot > 0) {
+    if (ip->nmap)
+      mapupdate(ip, off, (char *)addr, tot);
+    if (off + tot > ip->size) {
+      ip->size = off + tot;
+      ip->dirty = 1;
+    }
+  }
+  if (tot == m && tot < n) {
+    if (write)
+      r = writei(ip, 1, addr + tot, off + tot, n - tot);
+    else
+      r = readi(ip, 1, addr + tot, off + tot, n - tot);
+    if (r > 0)
+      tot += r;
+  }
+  return tot;
+}
+
 // Directories
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 
+// Name cache
+//
+// dcache remembers the outcome of recent dirlookups: for a
+// directory and a name, the inum and offset of its entry, or that
+// there is none. It is direct-mapped on a hash of both, so a hit
+// costs one probe. dirlink, dirunlink and dirrehash keep it up to
+// date, and iput drops a directory's names when it frees it.
+
+struct dentry {
+  uint dev;
+  uint dinum; // directory, 0 if the slot is unused
+  uint inum;  // 0 if name is known not to exist
+  uint off;   // offset of name's dirent
+  char name[DIRSIZ];
+};
+
+static struct dentry dcache[NDCACHE];
+
+static uint dirhashname(char *);
+
+static struct dentry *dcacheslot(struct inode *dp, char *name) {
+  return &dcache[(dirhashname(name) ^ dp->inum * 2654435761u) % NDCACHE];
+}
+
+// Return the cached entry for name in dp, or 0 if there is none.
+static struct dentry *dcacheget(struct inode *dp, char *name) {
+  struct dentry *d = dcacheslot(dp, name);
+
+  if (d->dinum == dp->inum && d->dev == dp->dev &&
+      namecmp(d->name, name) == 0)
+    return d;
+  return 0;
+}
+
+static void dcacheput(struct inode *dp, char *name, uint inum, uint off) {
+  struct dentry *d = dcacheslot(dp, name);
+
+  d->dev = dp->dev;
+  d->dinum = dp->inum;
+  d->inum = inum;
+  d->off = off;
+  strncpy(d->name, name, DIRSIZ);
+}
+
+// Forget every name cached for directory dp.
+static void dcachepurge(struct inode *dp) {
+  struct dentry *d;
+
+  for (d = dcache; d < dcache + NDCACHE; d++) {
+    if (d->dinum == dp->inum && d->dev == dp->dev)
+      d->dinum = 0;
+  }
+}
+
+// Hashed directories
+//
+// A hashed directory of nbucket buckets is nbucket blocks long;
+// name hashes to block dirhashname(name) % nbucket, and the
+// entries after the block's header hold the names that hash
+// there. A full bucket makes dirlink rebuild the directory with
+// twice the buckets (dirrehash), so lookups read at most two
+// blocks however many entries the directory has.
+
+static uint dirhashname(char *name) {
+  uint h = 2166136261u; // FNV-1a
+  int i;
+
+  for (i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619u;
+  return h;
+}
+
+// Return the number of buckets of directory dp, or 0 if its
+// entries are a plain list. A plain directory starts with ".".
+static uint dirbuckets(struct inode *dp) {
+  struct buf *bp;
+  struct dirhdr *h;
+  uint nb = 0, addr;
+
+  if (dp->size < BSIZE || (addr = bmapget(dp, 0)) == 0)
+    return 0;
+  bp = bread(dp->dev, addr);
+  h = (struct dirhdr *)bp->data;
+  if (h->inum == 0 && strncmp(h->magic, DIRMAGIC, sizeof(h->magic)) == 0)
+    nb = h->nbucket;
+  brelse(bp);
+  return nb;
+}
+
+// Rebuild directory dp as a hash table of at least nb buckets,
+// doubling nb until every bucket has a free entry. The new blocks
+// are written to a scratch inode and then swapped into dp, so dp
+// is unchanged if the disk fills up.
+// Returns 0 on success, -1 on failure.
+static int dirrehash(struct inode *dp, uint nb) {
+  struct dirent *de, *sorted;
+  struct dirhdr *h;
+  struct inode *tp;
+  struct buf *bp;
+  uint i, n, m, b, addr, *first;
+  uint addrs[NDIRECT + 2];
+  int r = -1;
+
+  n = dp->size / sizeof(struct dirent);
+  if ((de = malloc(dp->size)) == 0)
+    return -1;
+  if (readi(dp, 0, (uint64)de, 0, dp->size) != dp->size)
+    panic("dirrehash: readi");
+  for (i = m = 0; i < n; i++) {
+    if (de[i].inum)
+      de[m++] = de[i];
+  }
+
+  // Sort the entries by bucket.
+  sorted = 0;
+  first = 0;
+  for (;;) {
+    if (nb > MAXFILESIZE / BSIZE)
+      goto out;
+    if ((first = calloc(nb + 1, sizeof(uint))) == 0)
+      goto out;
+    for (i = 0; i < m; i++)
+      first[dirhashname(de[i].name) % nb + 1]++;
+    for (b = 0; b < nb && first[b + 1] < DPB - 1; b++)
+      ;
+    if (b == nb)
+      break;
+    free(first);
+    first = 0;
+    nb *= 2;
+  }
+  for (b = 0; b < nb; b++)
+    first[b + 1] += first[b];
+  // an empty directory has nothing to sort, and every bucket
+  // starts out empty.
+  if (m > 0) {
+    if ((sorted = malloc(m * sizeof(struct dirent))) == 0)
+      goto out;
+    for (i = 0; i < m; i++)
+      sorted[first[dirhashname(de[i].name) % nb]++] = de[i];
+  }
+  // first[b] is now where bucket b + 1 starts.
+
+  if ((tp = ialloc(dp->dev, T_DIR)) == 0)
+    goto out;
+  ilock(tp);
+  // nothing refers to tp's blocks until the swap below commits,
+  // so they are written like file data instead of through the log.
+  for (b = 0, i = 0; b < nb; b++) {
+    if ((addr = bmap(tp, b)) == 0)
+      break;
+    bp = boverwrite(tp->dev, addr);
+    memset(bp->data, 0, BSIZE);
+    h = (struct dirhdr *)bp->data;
+    memmove(h->magic, DIRMAGIC, sizeof(h->magic));
+    h->nbucket = nb;
+    if (first[b] > i)
+      memmove(bp->data + sizeof(struct dirent), &sorted[i],
+              (first[b] - i) * sizeof(struct dirent));
+    i = first[b];
+    bdirty(bp, tp->inum);
+    brelse(bp);
+    tp->size = (b + 1) * BSIZE;
+  }
+  if (b == nb) {
+    memmove(addrs, dp->addrs, sizeof(addrs));
+    memmove(dp->addrs, tp->addrs, sizeof(addrs));
+    memmove(tp->addrs, addrs, sizeof(addrs));
+    tp->size = dp->size;
+    dp->size = nb * BSIZE;
+    memset(dp->bmc, 0, sizeof(dp->bmc));
+    memset(tp->bmc, 0, sizeof(tp->bmc));
+    dp->dirty = 1;
+    iupdate(dp);
+    dcachepurge(dp);
+    r = 0;
+  }
+  // tp has no links: iput frees it, and with it the old blocks.
+  tp->nlink = 0;
+  iunlockput(tp);
+
+out:
+  free(sorted);
+  free(first);
+  free(de);
+  return r;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, nb, b, i, addr;
+  struct dirent de, *d;
+  struct dentry *dc;
+  struct buf *bp;
 
   if (dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if ((dc = dcacheget(dp, name)) != 0) {
+    if (dc->inum == 0)
+      return 0;
+    if (poff)
+      *poff = dc->off;
+    return iget(dp->dev, dc->inum);
+  }
+
+  if ((nb = dirbuckets(dp)) != 0) {
+    b = dirhashname(name) % nb;
+    if ((addr = bmapget(dp, b)) == 0)
+      return 0;
+    bp = bread(dp->dev, addr);
+    d = (struct dirent *)bp->data;
+    for (i = 1; i < DPB; i++) {
+      if (d[i].inum && namecmp(name, d[i].name) == 0) {
+        off = b * BSIZE + i * sizeof(de);
+        if (poff)
+          *poff = off;
+        inum = d[i].inum;
+        brelse(bp);
+        dcacheput(dp, name, inum, off);
+        return iget(dp->dev, inum);
+      }
+    }
+    brelse(bp);
+    dcacheput(dp, name, 0, 0);
+    return 0;
+  }
+
   for (off = 0; off < dp->size; off += sizeof(de)) {
     if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -759,10 +1837,12 @@ struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
       if (poff)
         *poff = off;
       inum = de.inum;
+      dcacheput(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheput(dp, name, 0, 0);
   return 0;
 }
 
@@ -770,8 +1850,10 @@ struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int dirlink(struct inode *dp, char *name, uint inum) {
   int off;
-  struct dirent de;
+  uint nb, b, i, addr;
+  struct dirent de, *d;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if ((ip = dirlookup(dp, name, 0)) != 0) {
@@ -779,22 +1861,108 @@ int dirlink(struct inode *dp, char *name, uint inum) {
     return -1;
   }
 
+  strncpy(de.name, name, DIRSIZ);
+  de.inum = inum;
+
+  while ((nb = dirbuckets(dp)) != 0) {
+    // Take a free entry in name's bucket, or rehash.
+    b = dirhashname(name) % nb;
+    if ((addr = bmapget(dp, b)) == 0)
+      return -1;
+    bp = bread(dp->dev, addr);
+    d = (struct dirent *)bp->data;
+    for (i = 1; i < DPB && d[i].inum; i++)
+      ;
+    if (i < DPB) {
+      d[i] = de;
+      ilogwrite(dp, bp);
+      brelse(bp);
+      dcacheput(dp, name, inum, b * BSIZE + i * sizeof(de));
+      return 0;
+    }
+    brelse(bp);
+    if (dirrehash(dp, nb * 2) < 0)
+      return -1;
+  }
+
   // Look for an empty dirent.
   for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    struct dirent e;
+
+    if (readi(dp, 0, (uint64)&e, off, sizeof(e)) != sizeof(e))
       panic("dirlink read");
-    if (de.inum == 0)
+    if (e.inum == 0)
       break;
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
+  // A full directory past NDIRLINEAR blocks becomes hashed, with
+  // buckets about half full.
+  if (off >= NDIRLINEAR * BSIZE) {
+    for (nb = 1; nb * (DPB - 1) / 2 < off / sizeof(de) + 1; nb *= 2)
+      ;
+    if (dirrehash(dp, nb) == 0)
+      return dirlink(dp, name, inum);
+  }
+
   if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcacheput(dp, name, inum, off);
 
   return 0;
 }
 
+// Pack the entries of directory dp from offset *off on into dst
+// as struct fsdirent records, as many as fit in n bytes, and
+// advance *off past them. Returns the number of bytes used, or
+// -EIO if a block of the directory is missing.
+// Caller must hold dp->lock.
+int dirread(struct inode *dp, uint64 dst, int n, uint *off) {
+  struct buf *bp;
+  struct dirent *de;
+  struct fsdirent *r;
+  int tot, len, reclen;
+  uint addr;
+
+  tot = 0;
+  while (*off < dp->size) {
+    if ((addr = bmapget(dp, *off / BSIZE)) == 0)
+      return -EIO;
+    bp = bread(dp->dev, addr);
+    de = (struct dirent *)(bp->data + *off % BSIZE);
+    for (; (uchar *)de < bp->data + BSIZE && *off < dp->size;
+         de++, *off += sizeof(*de)) {
+      if (de->inum == 0)
+        continue;
+      for (len = 0; len < DIRSIZ && de->name[len]; len++)
+        ;
+      reclen = (sizeof(*r) + len + 1 + 7) & ~7;
+      if (tot + reclen > n) {
+        brelse(bp);
+        return tot;
+      }
+      r = (struct fsdirent *)(dst + tot);
+      r->off = *off + sizeof(*de);
+      r->inum = de->inum;
+      r->reclen = reclen;
+      memmove(r->name, de->name, len);
+      r->name[len] = 0;
+      tot += reclen;
+    }
+    brelse(bp);
+  }
+  return tot;
+}
+
+// Remove the entry for name, at offset off, from directory dp.
+void dirunlink(struct inode *dp, char *name, uint off) {
+  struct dirent de;
+
+  memset(&de, 0, sizeof(de));
+  if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("unlink: writei");
+  dcacheput(dp, name, 0, 0);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
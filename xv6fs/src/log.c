@@ -0,0 +1,227 @@
+#include "defs.h"
+
+// Simple logging with group commit.
+//
+// A log transaction contains the updates of one or more FS
+// system calls. The logging system only commits when there
+// are no FS system calls active. Thus there is never
+// any reasoning required about whether a commit might
+// write an uncommitted system call's updates to disk.
+//
+// A system call should call begin_op()/end_op() to mark
+// its start and end. end_op() does not commit: the
+// transaction stays open and later calls add their updates
+// to it, so back-to-back calls share one log write and one
+// commit record, and a block they all change (an inode, a
+// bitmap block) is logged once. The log is committed when the
+// next call might not fit in it, when the server has been idle
+// for a while, every NREQCOMMIT calls, and by log_flush() on
+// behalf of fsync.
+//
+// Only metadata is logged: inode, bitmap, indirect, extent and
+// directory blocks. File data is written in place through the
+// buffer cache (see bdirty) and flushed before the commit that
+// makes it reachable, so a committed inode never points at
+// blocks that were not written.
+//
+// The log is a physical re-do log containing disk blocks.
+// The on-disk log format:
+//   header block, containing block #s for block A, B, C, ...
+//   block A
+//   block B
+//   block C
+//   ...
+// Log appends are synchronous.
+
+// Contents of the header block, used for both the on-disk header block
+// and to keep track in memory of logged block# before commit.
+struct logheader {
+  int n;
+  int block[LOGSIZE];
+};
+
+struct log {
+  //   struct spinlock lock;
+  int start;
+  int size;
+  int outstanding; // how many FS sys calls are executing.
+  int dev;
+  uint seq; // number of the open transaction
+  struct logheader lh;
+};
+static struct log logstate;
+
+static void recover_from_log(void);
+static void commit(void);
+
+void initlog(int dev, struct superblock *sb) {
+  if (sizeof(struct logheader) >= sb->bsize)
+    panic("initlog: too big logheader");
+
+  //   initlock(&logstate.lock, "log");
+  logstate.start = sb->logstart;
+  logstate.size = sb->nlog;
+  logstate.dev = dev;
+  logstate.seq = 1;
+  recover_from_log();
+}
+
+// Copy committed blocks from log to their home location
+static void install_trans(int recovering) {
+  int tail;
+
+  for (tail = 0; tail < logstate.lh.n; tail++) {
+    struct buf *dbuf = bread(logstate.dev, logstate.lh.block[tail]); // read dst
+    if (recovering) {
+      struct buf *lbuf = bread(logstate.dev, logstate.start + tail + 1); // read log block
+      memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
+      brelse(lbuf);
+    }
+    // otherwise the pinned buffer still holds what was logged.
+    bwrite(dbuf); // write dst to disk
+    if (recovering == 0)
+      bunpin(dbuf);
+    brelse(dbuf);
+  }
+}
+
+// Read the log header from disk into the in-memory log header
+static void read_head(void) {
+  struct buf *buf = bread(logstate.dev, logstate.start);
+  struct logheader *lh = (struct logheader *)(buf->data);
+  int i;
+  logstate.lh.n = lh->n;
+  for (i = 0; i < logstate.lh.n; i++) {
+    logstate.lh.block[i] = lh->block[i];
+  }
+  brelse(buf);
+}
+
+// Write in-memory log header to disk.
+// This is the true point at which the
+// current transaction commits.
+static void write_head(void) {
+  struct buf *buf = boverwrite(logstate.dev, logstate.start);
+  struct logheader *hb = (struct logheader *)(buf->data);
+  int i;
+  memset(buf->data, 0, BSIZE);
+  hb->n = logstate.lh.n;
+  for (i = 0; i < logstate.lh.n; i++) {
+    hb->block[i] = logstate.lh.block[i];
+  }
+  bwrite(buf);
+  brelse(buf);
+}
+
+static void recover_from_log(void) {
+  read_head();
+  install_trans(1); // if committed, copy from log to disk
+  logstate.lh.n = 0;
+  write_head(); // clear the log
+}
+
+// called at the start of each FS system call.
+void begin_op(void) {
+  //   acquire(&logstate.lock);
+  if (logstate.lh.n + (logstate.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
+    // this op might exhaust log space. nothing else runs while
+    // a call is in progress, so there is no one to wait for.
+    if (logstate.outstanding > 0)
+      panic("begin_op: log full");
+    commit();
+  } else if (logstate.outstanding == 0 && bfreewaiting()) {
+    // the disk is filling up, and committing frees blocks.
+    commit();
+  }
+  logstate.outstanding += 1;
+  //   release(&logstate.lock);
+}
+
+// called at the end of each FS system call.
+// leaves the transaction open for the calls that follow.
+void end_op(void) {
+  //   acquire(&logstate.lock);
+  if (logstate.outstanding < 1)
+    panic("end_op");
+  logstate.outstanding -= 1;
+  //   release(&logstate.lock);
+}
+
+// Commit the open transaction, if it holds anything, and write
+// back all file data. Must not be called inside an FS call.
+void log_flush(void) {
+  if (logstate.outstanding > 0)
+    panic("log_flush");
+  bflush();
+  commit();
+}
+
+// Number of the open transaction. Every transaction numbered
+// lower has committed.
+uint log_seq(void) { return logstate.seq; }
+
+// Make sure transaction seq has committed, committing the open
+// transaction if that is the one. Must not be called inside an
+// FS call.
+void log_sync(uint seq) {
+  if (seq == logstate.seq && logstate.lh.n > 0)
+    log_flush();
+}
+
+// Copy modified blocks from cache to log.
+static void write_log(void) {
+  int tail;
+
+  for (tail = 0; tail < logstate.lh.n; tail++) {
+    struct buf *to = boverwrite(logstate.dev, logstate.start + tail + 1); // log block
+    struct buf *from = bread(logstate.dev, logstate.lh.block[tail]); // cache block
+    memmove(to->data, from->data, BSIZE);
+    bwrite(to); // write the log
+    brelse(from);
+    brelse(to);
+  }
+}
+
+static void commit(void) {
+  if (logstate.lh.n > 0) {
+    bflush();         // Write file data the metadata refers to
+    write_log();      // Write modified blocks from cache to log
+    write_head();     // Write header to disk -- the real commit
+    install_trans(0); // Now install writes to home locations
+    logstate.lh.n = 0;
+    write_head(); // Erase the transaction from the log
+    logstate.seq++;
+    bheldrelease(); // blocks freed by the transaction are free now
+  }
+}
+
+// Caller has modified b->data and is done with the buffer.
+// Record the block number and pin in the cache by increasing refcnt.
+// commit()/write_log() will do the disk write.
+//
+// log_write() replaces bwrite(); a typical use is:
+//   bp = bread(...)
+//   modify bp->data[]
+//   log_write(bp)
+//   brelse(bp)
+void log_write(struct buf *b) {
+  int i;
+
+  //   acquire(&logstate.lock);
+  if (logstate.lh.n >= LOGSIZE || logstate.lh.n >= logstate.size - 1)
+    panic("too big a transaction");
+  if (logstate.outstanding < 1)
+    panic("log_write outside of trans");
+
+  for (i = 0; i < logstate.lh.n; i++) {
+    if (logstate.lh.block[i] == b->blockno) // log absorption
+      break;
+  }
+  logstate.lh.block[i] = b->blockno;
+  b->dirty = 0; // the logged copy supersedes any in-place write
+  if (i == logstate.lh.n) { // Add new block to log?
+    bpin(b);
+    logstate.lh.n++;
+  }
+  //   release(&logstate.lock);
+}
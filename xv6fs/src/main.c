@@ -35,6 +35,14 @@ static size_t write_buf(void *data, size_t count) {
 }
 
 #ifdef TEST_NORMAL
+void disk_init(int bsize) {
+  seL4_MessageInfo_t info = seL4_MessageInfo_new(DISK_INIT, 0, 0, 1);
+  seL4_SetMR(0, bsize);
+  info = seL4_Call(server_ep, info);
+  if (seL4_GetMR(0))
+    panic("Failed to initialize disk");
+}
+
 void disk_rw(void *buf, int blockno, int write) {
   if (write) {
     seL4_MessageInfo_t info = seL4_MessageInfo_new(DISK_WRITE, 0, 0, 1);
@@ -52,7 +60,39 @@ void disk_rw(void *buf, int blockno, int write) {
     memmove(buf, init_data->server_buf, BSIZE);
   }
 }
+
+void disk_readn(void **bufs, int blockno, int n) {
+  seL4_MessageInfo_t info = seL4_MessageInfo_new(DISK_READN, 0, 0, 2);
+  seL4_SetMR(0, blockno);
+  seL4_SetMR(1, n);
+  info = seL4_Call(server_ep, info);
+  if (seL4_GetMR(0))
+    panic("Failed to read blocks");
+  for (int i = 0; i < n; i++)
+    memmove(bufs[i], (char *)init_data->server_buf + i * BSIZE, BSIZE);
+}
+
+void disk_writen(void **bufs, int blockno, int n) {
+  seL4_MessageInfo_t info = seL4_MessageInfo_new(DISK_WRITEN, 0, 0, 2);
+  for (int i = 0; i < n; i++)
+    memmove((char *)init_data->server_buf + i * BSIZE, bufs[i], BSIZE);
+  seL4_SetMR(0, blockno);
+  seL4_SetMR(1, n);
+  info = seL4_Call(server_ep, info);
+  if (seL4_GetMR(0))
+    panic("Failed to write blocks");
+}
 #elif defined(TEST_POLL)
+void disk_init(int bsize) {
+  seL4_Word *server_buf = init_data->server_buf;
+  acquire(init_data->server_lk);
+  server_buf[0] = DISK_INIT;
+  server_buf[1] = bsize;
+  release(init_data->server_lk);
+  if (Call(server_buf))
+    panic("Failed to initialize disk");
+}
+
 void disk_rw(void *buf, int blockno, int write) {
   if (write) {
     seL4_Word *server_buf = init_data->server_buf;
@@ -76,6 +116,34 @@ void disk_rw(void *buf, int blockno, int write) {
     release(init_data->server_lk);
   }
 }
+
+void disk_readn(void **bufs, int blockno, int n) {
+  seL4_Word *server_buf = init_data->server_buf;
+  acquire(init_data->server_lk);
+  server_buf[0] = DISK_READN;
+  server_buf[1] = blockno;
+  server_buf[2] = n;
+  release(init_data->server_lk);
+  Wait(server_buf);
+  if (server_buf[1])
+    panic("Failed to read blocks");
+  for (int i = 0; i < n; i++)
+    memmove(bufs[i], (char *)&server_buf[3] + i * BSIZE, BSIZE);
+  release(init_data->server_lk);
+}
+
+void disk_writen(void **bufs, int blockno, int n) {
+  seL4_Word *server_buf = init_data->server_buf;
+  acquire(init_data->server_lk);
+  server_buf[0] = DISK_WRITEN;
+  server_buf[1] = blockno;
+  server_buf[2] = n;
+  for (int i = 0; i < n; i++)
+    memmove((char *)&server_buf[3] + i * BSIZE, bufs[i], BSIZE);
+  release(init_data->server_lk);
+  if (Call(server_buf))
+    panic("Failed to write blocks");
+}
 #elif defined(TEST_UINTR)
 static void CallBadged() {
   seL4_Word badge;
@@ -90,6 +158,15 @@ static void CallBadged() {
   }
 }
 
+void disk_init(int bsize) {
+  seL4_Word *server_buf = init_data->server_buf;
+  server_buf[0] = DISK_INIT;
+  server_buf[1] = bsize;
+  CallBadged();
+  if (server_buf[1])
+    panic("Failed to initialize disk");
+}
+
 void disk_rw(void *buf, int blockno, int write) {
   if (write) {
     seL4_Word *server_buf = init_data->server_buf;
@@ -109,6 +186,61 @@ void disk_rw(void *buf, int blockno, int write) {
     memmove(buf, &server_buf[2], BSIZE);
   }
 }
+
+void disk_readn(void **bufs, int blockno, int n) {
+  seL4_Word *server_buf = init_data->server_buf;
+  server_buf[0] = DISK_READN;
+  server_buf[1] = blockno;
+  server_buf[2] = n;
+  CallBadged();
+  if (server_buf[1])
+    panic("Failed to read blocks");
+  for (int i = 0; i < n; i++)
+    memmove(bufs[i], (char *)&server_buf[3] + i * BSIZE, BSIZE);
+}
+
+void disk_writen(void **bufs, int blockno, int n) {
+  seL4_Word *server_buf = init_data->server_buf;
+  server_buf[0] = DISK_WRITEN;
+  server_buf[1] = blockno;
+  server_buf[2] = n;
+  for (int i = 0; i < n; i++)
+    memmove((char *)&server_buf[3] + i * BSIZE, bufs[i], BSIZE);
+  CallBadged();
+  if (server_buf[1])
+    panic("Failed to write blocks");
+}
+#endif
+
+// Free some blocks of truncated files, if there are any.
+static void reclaim(void) {
+  if (!ireclaimable())
+    return;
+  begin_op();
+  ireclaim(NRECLAIM);
+  end_op();
+}
+
+// Polls since the last request. Once the client has been quiet
+// for NIDLECOMMIT of them, the open log transaction is committed.
+// A blocking seL4_Recv has no such moment, and a busy client may
+// never be quiet, so the log is also committed every NREQCOMMIT
+// requests.
+static int nidle;
+static int nreq;
+
+#ifndef TEST_NORMAL
+static void idle(void) {
+  // queued async requests are work, not idleness.
+  if (asyncrun(NFSRING) > 0) {
+    leaseupdate();
+    nidle = 0;
+    return;
+  }
+  reclaim();
+  if (++nidle == NIDLECOMMIT)
+    log_flush();
+}
 #endif
 
 int main(int argc, char **argv) {
@@ -137,6 +269,13 @@ int main(int argc, char **argv) {
   iinit();
   fileinit();
   fsinit(ROOTDEV);
+  // the map window follows the request pages; under TEST_POLL
+  // the spinlock sits at the start of the shared buffer.
+#ifdef TEST_POLL
+  mapinit((char *)init_data->client_lk + FSMAPOFF);
+#else
+  mapinit((char *)init_data->client_buf + FSMAPOFF);
+#endif
   printf("[xv6fs] fs initialized successfully\n");
 
   while (1) {
@@ -149,6 +288,7 @@ int main(int argc, char **argv) {
     argint(-1, &label);
     if (label == FS_RET) {
       release(init_data->client_lk);
+      idle();
       continue;
     }
 #elif defined(TEST_UINTR)
@@ -157,8 +297,10 @@ int main(int argc, char **argv) {
     /* write the pending bits back */
     if (badge & 2)
       uipi_write(2);
-    if ((badge & 1) == 0)
+    if ((badge & 1) == 0) {
+      idle();
       continue;
+    }
     argint(-1, &label);
 #endif
     switch (label) {
@@ -195,11 +337,67 @@ int main(int argc, char **argv) {
     case FS_UNLINK:
       ret = xv6fs_unlink();
       break;
+    case FS_FALLOCATE:
+      ret = xv6fs_fallocate();
+      break;
+    case FS_GETDENTS:
+      ret = xv6fs_getdents();
+      break;
+    case FS_PREADV:
+      ret = xv6fs_preadv();
+      break;
+    case FS_PWRITEV:
+      ret = xv6fs_pwritev();
+      break;
+    case FS_FSYNC:
+      ret = xv6fs_fsync();
+      break;
+    case FS_FDATASYNC:
+      ret = xv6fs_fdatasync();
+      break;
+    case FS_MMAP:
+      ret = xv6fs_mmap();
+      break;
+    case FS_MSYNC:
+      ret = xv6fs_msync();
+      break;
+    case FS_MUNMAP:
+      ret = xv6fs_munmap();
+      break;
+    case FS_SHM_MAP:
+      ret = xv6fs_shm_map();
+      break;
+    case FS_SHM_UNMAP:
+      ret = xv6fs_shm_unmap();
+      break;
+    case FS_ASYNC_SETUP:
+      ret = xv6fs_async_setup();
+      break;
+    case FS_ASYNC_ENTER:
+      ret = xv6fs_async_enter();
+      break;
+    case FS_COMPOUND:
+      ret = xv6fs_compound();
+      break;
+    case FS_LEASE_SETUP:
+      ret = xv6fs_lease_setup();
+      break;
+#ifndef TEST_NORMAL
+    // the client must poll the area while the request runs,
+    // which a blocked seL4_Call cannot do.
+    case FS_PREAD_STREAM:
+      ret = xv6fs_pread_stream();
+      break;
+    case FS_PWRITE_STREAM:
+      ret = xv6fs_pwrite_stream();
+      break;
+#endif
     default:
       ret = -EINVAL;
       break;
     }
     // printf("[xv6fs] FS call %d return %d\n", label, ret);
+    leaseupdate();
 #ifdef TEST_NORMAL
     info = seL4_MessageInfo_new(seL4_MessageInfo_get_label(info), 0, 0, 1);
     seL4_SetMR(0, ret);
@@ -215,6 +413,14 @@ int main(int argc, char **argv) {
     buf[1] = ret;
     seL4_UintrSend(client_index);
 #endif
+    // the client is already answered; free some blocks of
+    // truncated files before taking the next request.
+    reclaim();
+    nidle = 0;
+    if (++nreq == NREQCOMMIT) {
+      log_flush();
+      nreq = 0;
+    }
   }
 
   return 0;
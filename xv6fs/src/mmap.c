@@ -0,0 +1,264 @@
+// Memory-mapped files.
+//
+// xv6fs cannot hand buffer-cache frames to the app: a buf is not
+// page-aligned and the server holds no caps to its own pages.
+// Instead the rootserver shares a window of FSMAPSIZE bytes after
+// the request pages of the app<->fs buffer, and FS_MMAP copies a
+// file range into a free, page-aligned part of it. The app then
+// reads the range with plain loads and no request at all.
+//
+// The server keeps every mapping coherent with the file: writei
+// copies each write into the mappings of its inode (mapupdate),
+// and itrunc clears them (mapzero). Stores the app makes into a
+// writable mapping reach the file only through FS_MSYNC or
+// FS_MUNMAP, which write the range back with writei; bytes past
+// the end of the file are not written.
+//
+// The window also holds shared-memory objects (FS_SHM_MAP), such
+// as sqlite's wal-index: named, zero-filled regions with no file
+// behind them, which live until FS_SHM_UNMAP deletes them.
+
+#include "defs.h"
+
+struct mapping {
+  struct inode *ip; // 0 if the slot is free
+  uint off;         // file offset of the first mapped byte
+  uint len;         // bytes mapped, a multiple of FSPGSIZE
+  uint woff;        // where the mapping starts in the window
+  int writable;
+};
+
+struct shm {
+  char name[MAXPATH]; // "" if the slot is free
+  uint size;          // bytes per region
+  int nregion;
+  uint woff[NSHMREGION]; // where each region starts in the window
+};
+
+static struct {
+  char *window;
+  struct mapping m[NFSMAP];
+  struct shm shm[NSHM];
+  uchar used[FSMAPSIZE / FSPGSIZE]; // window page in use?
+} mtable;
+
+// Called by main once the shared buffers are known.
+void mapinit(void *window) { mtable.window = window; }
+
+// Take len bytes, a multiple of FSPGSIZE, of the window.
+// Returns the first page or -1.
+static int mapalloc(uint len) {
+  uint i, n, run;
+
+  n = len / FSPGSIZE;
+  if (mtable.window == 0 || n > FSMAPSIZE / FSPGSIZE)
+    return -1;
+  for (i = 0, run = 0; i < FSMAPSIZE / FSPGSIZE; i++) {
+    run = mtable.used[i] ? 0 : run + 1;
+    if (run == n) {
+      i = i + 1 - n;
+      for (run = 0; run < n; run++)
+        mtable.used[i + run] = 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Give back the len bytes of the window at woff.
+static void mapfree(uint woff, uint len) {
+  uint i;
+
+  for (i = 0; i < len / FSPGSIZE; i++)
+    mtable.used[woff / FSPGSIZE + i] = 0;
+}
+
+// The len bytes of the window at woff, or 0 if they do not fit.
+void *mapaddr(uint woff, uint len) {
+  if (mtable.window == 0 || woff > FSMAPSIZE || len > FSMAPSIZE - woff)
+    return 0;
+  return mtable.window + woff;
+}
+
+// Whether the len bytes at addr lie in the app<->fs buffer: the
+// request pages in front of the window, or the window itself.
+int mapshared(uint64 addr, uint64 len) {
+  uint64 lo, hi;
+
+  if (mtable.window == 0)
+    return 0;
+  lo = (uint64)mtable.window - FSMAPOFF;
+  hi = (uint64)mtable.window + FSMAPSIZE;
+  return addr >= lo && addr <= hi && len <= hi - addr;
+}
+
+// The mapping that contains window offset woff.
+static struct mapping *mapfind(uint woff) {
+  struct mapping *m;
+
+  for (m = mtable.m; m < mtable.m + NFSMAP; m++) {
+    if (m->ip && woff >= m->woff && woff < m->woff + m->len)
+      return m;
+  }
+  return 0;
+}
+
+// Map len bytes of file f from off, which must be page-aligned,
+// into the window. Returns the window offset of the mapping.
+int mapfile(struct file *f, uint off, uint len, int writable) {
+  struct mapping *m;
+  struct inode *ip;
+  int pg;
+
+  if (f->type != FD_INODE)
+    return -ENODEV;
+  if (!f->readable || (writable && !f->writable))
+    return -EACCES;
+  if (off % FSPGSIZE || len == 0 || off + len < off)
+    return -EINVAL;
+  len = (len + FSPGSIZE - 1) & ~(FSPGSIZE - 1);
+  for (m = mtable.m; m < mtable.m + NFSMAP && m->ip; m++)
+    ;
+  if (m == mtable.m + NFSMAP || (pg = mapalloc(len)) < 0)
+    return -ENOMEM;
+
+  ip = idup(f->ip);
+  m->ip = ip;
+  m->off = off;
+  m->len = len;
+  m->woff = pg * FSPGSIZE;
+  m->writable = writable;
+
+  // bytes past the end of the file read as zeros.
+  memset(mtable.window + m->woff, 0, len);
+  ilock(ip);
+  readi(ip, 0, (uint64)(mtable.window + m->woff), off, len);
+  ip->nmap++;
+  iunlock(ip);
+  return m->woff;
+}
+
+// Write back the part of [woff, woff + len) of the window that
+// lies in the writable mapping containing woff and in its file.
+int mapsync(uint woff, uint len) {
+  struct mapping *m;
+  struct inode *ip;
+  uint off, end;
+  int r;
+
+  if ((m = mapfind(woff)) == 0)
+    return -EINVAL;
+  if (!m->writable)
+    return 0;
+  ip = m->ip;
+  if (len > m->woff + m->len - woff)
+    len = m->woff + m->len - woff;
+  off = m->off + (woff - m->woff);
+  ilock(ip);
+  end = off + len < ip->size ? off + len : ip->size;
+  r = 0;
+  if (off < end)
+    r = writeop(ip, (uint64)(mtable.window + woff), off, end - off);
+  iunlock(ip);
+  return r < 0 ? -EIO : 0;
+}
+
+// Write back and remove the mapping that starts at woff.
+int unmapfile(uint woff) {
+  struct mapping *m;
+  int r;
+
+  if ((m = mapfind(woff)) == 0 || m->woff != woff)
+    return -EINVAL;
+  r = mapsync(woff, m->len);
+  ilock(m->ip);
+  m->ip->nmap--;
+  iunlock(m->ip);
+  begin_op();
+  iput(m->ip);
+  end_op();
+  m->ip = 0;
+  mapfree(m->woff, m->len);
+  return r;
+}
+
+// Copy the n bytes just written to ip at off from src into the
+// mappings of ip. Caller must hold ip->lock.
+void mapupdate(struct inode *ip, uint off, char *src, uint n) {
+  struct mapping *m;
+  uint lo, hi;
+
+  for (m = mtable.m; m < mtable.m + NFSMAP; m++) {
+    if (m->ip != ip)
+      continue;
+    lo = off > m->off ? off : m->off;
+    hi = off + n < m->off + m->len ? off + n : m->off + m->len;
+    if (lo < hi)
+      memmove(mtable.window + m->woff + (lo - m->off), src + (lo - off),
+              hi - lo);
+  }
+}
+
+// ip has been truncated: its mappings now read as zeros.
+// Caller must hold ip->lock.
+void mapzero(struct inode *ip) {
+  struct mapping *m;
+
+  for (m = mtable.m; m < mtable.m + NFSMAP; m++) {
+    if (m->ip == ip)
+      memset(mtable.window + m->woff, 0, m->len);
+  }
+}
+
+static struct shm *shmfind(char *name) {
+  struct shm *sh;
+
+  for (sh = mtable.shm; sh < mtable.shm + NSHM; sh++) {
+    if (sh->name[0] && strncmp(sh->name, name, MAXPATH) == 0)
+      return sh;
+  }
+  return 0;
+}
+
+// Return the window offset of region i, of size bytes, of the
+// shared-memory object name, creating the object and the regions
+// up to i as needed. Every region of an object has the same size.
+int shmmap(char *name, int i, uint size) {
+  struct shm *sh;
+  int pg;
+
+  if (name[0] == 0 || i < 0 || i >= NSHMREGION || size == 0)
+    return -EINVAL;
+  size = (size + FSPGSIZE - 1) & ~(FSPGSIZE - 1);
+  if ((sh = shmfind(name)) == 0) {
+    for (sh = mtable.shm; sh < mtable.shm + NSHM && sh->name[0]; sh++)
+      ;
+    if (sh == mtable.shm + NSHM)
+      return -ENOMEM;
+    strncpy(sh->name, name, MAXPATH - 1);
+    sh->size = size;
+    sh->nregion = 0;
+  }
+  if (size != sh->size)
+    return -EINVAL;
+  while (sh->nregion <= i) {
+    if ((pg = mapalloc(size)) < 0)
+      return -ENOMEM;
+    sh->woff[sh->nregion++] = pg * FSPGSIZE;
+    memset(mtable.window + pg * FSPGSIZE, 0, size);
+  }
+  return sh->woff[i];
+}
+
+// Delete the shared-memory object name and free its regions.
+int shmunmap(char *name) {
+  struct shm *sh;
+  int i;
+
+  if ((sh = shmfind(name)) == 0)
+    return -ENOENT;
+  for (i = 0; i < sh->nregion; i++)
+    mapfree(sh->woff[i], sh->size);
+  sh->name[0] = 0;
+  return 0;
+}
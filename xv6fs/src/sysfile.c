@@ -87,12 +87,7 @@ uint64 xv6fs_pread(void) {
     return -EBADF;
 
   argaddr(3, &off);
-  if (fileseek(f, (off_t)off, SEEK_SET) < 0) {
-    // read out of bound and return nothing
-    return -EINVAL;
-  }
-
-  return fileread(f, p, n);
+  return filerwat(f, p, n, off, 0);
 }
 
 uint64 xv6fs_pwrite(void) {
@@ -104,14 +99,10 @@ uint64 xv6fs_pwrite(void) {
   argaddr(1, &p);
   argint(2, &n);
   if (argfd(0, 0, &f) < 0)
-    return -1;
+    return -EBADF;
 
   argaddr(3, &off);
-  if (fileseek(f, (off_t)off, SEEK_SET) < 0) {
-    return -EINVAL;
-  }
-
-  return filewrite(f, p, n);
+  return filerwat(f, p, n, off, 1);
 }
 
 uint64 xv6fs_close(void) {
@@ -143,16 +134,16 @@ uint64 xv6fs_link(void) {
   if (argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  // begin_op();
+  begin_op();
   if ((ip = namei(old)) == 0) {
-    // end_op();
+    end_op();
     return -1;
   }
 
   ilock(ip);
   if (ip->type == T_DIR) {
     iunlockput(ip);
-    // end_op();
+    end_op();
     return -1;
   }
 
@@ -170,7 +161,7 @@ uint64 xv6fs_link(void) {
   iunlockput(dp);
   iput(ip);
 
-  // end_op();
+  end_op();
 
   return 0;
 
@@ -179,19 +170,21 @@ bad:
   ip->nlink--;
   iupdate(ip);
   iunlockput(ip);
-  // end_op();
+  end_op();
   return -1;
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// They need not come first in a hashed directory.
 static int isdirempty(struct inode *dp) {
   int off;
   struct dirent de;
 
-  for (off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
+  for (off = 0; off < dp->size; off += sizeof(de)) {
     if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if (de.inum != 0)
+    if (de.inum != 0 && namecmp(de.name, ".") != 0 &&
+        namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -199,16 +192,15 @@ static int isdirempty(struct inode *dp) {
 
 uint64 xv6fs_unlink(void) {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
   if (argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  // begin_op();
+  begin_op();
   if ((dp = nameiparent(path, name)) == 0) {
-    // end_op();
+    end_op();
     return -1;
   }
 
@@ -229,9 +221,7 @@ uint64 xv6fs_unlink(void) {
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if (ip->type == T_DIR) {
     dp->nlink--;
     iupdate(dp);
@@ -242,13 +232,13 @@ uint64 xv6fs_unlink(void) {
   iupdate(ip);
   iunlockput(ip);
 
-  // end_op();
+  end_op();
 
   return 0;
 
 bad:
   iunlockput(dp);
-  // end_op();
+  end_op();
   return -1;
 }
 
@@ -309,29 +299,25 @@ fail:
   return 0;
 }
 
-uint64 xv6fs_open() {
-  char path[MAXPATH];
-  int fd, omode;
+// Open path with flags omode. Returns the new fd.
+static int openpath(char *path, int omode) {
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
 
-  argint(1, &omode);
-  if ((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
-  // begin_op();
+  begin_op();
 
   // printf("[xv6fs] open %s 0o%o\n", path, omode);
 
   if (omode & O_CREAT) {
     ip = create(path, T_FILE, 0, 0);
     if (ip == 0) {
-      // end_op();
+      end_op();
       return -1;
     }
   } else {
     if ((ip = namei(path)) == 0) {
-      // end_op();
+      end_op();
       return -1;
     }
     ilock(ip);
@@ -344,7 +330,7 @@ uint64 xv6fs_open() {
 
   if (ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)) {
     iunlockput(ip);
-    // end_op();
+    end_op();
     return -1;
   }
 
@@ -352,7 +338,7 @@ uint64 xv6fs_open() {
     if (f)
       fileclose(f);
     iunlockput(ip);
-    // end_op();
+    end_op();
     return -1;
   }
 
@@ -366,28 +352,39 @@ uint64 xv6fs_open() {
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->direct = (omode & O_DIRECT) && ip->type == T_FILE;
 
   if ((omode & O_TRUNC) && ip->type == T_FILE) {
     itrunc(ip);
   }
 
   iunlock(ip);
-  // end_op();
+  end_op();
 
   return fd;
 }
 
+uint64 xv6fs_open() {
+  char path[MAXPATH];
+  int omode;
+
+  argint(1, &omode);
+  if (argstr(0, path, MAXPATH) < 0)
+    return -1;
+  return openpath(path, omode);
+}
+
 uint64 xv6fs_mkdir(void) {
   char path[MAXPATH];
   struct inode *ip;
 
-  // begin_op();
+  begin_op();
   if (argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0) {
-    // end_op();
+    end_op();
     return -1;
   }
   iunlockput(ip);
-  // end_op();
+  end_op();
   return 0;
 }
 
@@ -396,16 +393,16 @@ uint64 xv6fs_mknod(void) {
   char path[MAXPATH];
   int major, minor;
 
-  // begin_op();
+  begin_op();
   argint(1, &major);
   argint(2, &minor);
   if ((argstr(0, path, MAXPATH)) < 0 ||
       (ip = create(path, T_DEVICE, major, minor)) == 0) {
-    // end_op();
+    end_op();
     return -1;
   }
   iunlockput(ip);
-  // end_op();
+  end_op();
   return 0;
 }
 
@@ -414,20 +411,20 @@ uint64 xv6fs_chdir(void) {
   struct inode *ip;
   // struct proc *p = myproc();
 
-  // begin_op();
+  begin_op();
   if (argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
-    // end_op();
+    end_op();
     return -1;
   }
   ilock(ip);
   if (ip->type != T_DIR) {
     iunlockput(ip);
-    // end_op();
+    end_op();
     return -1;
   }
   iunlock(ip);
   iput(curr()->cwd);
-  // end_op();
+  end_op();
   curr()->cwd = ip;
   strncpy(curr()->cwd_path, path, MAXPATH);
   return 0;
@@ -456,11 +453,16 @@ uint64 xv6fs_lstat(void) {
 
   // printf("[xv6fs] lstat %s\n", path);
 
+  begin_op();
   if ((ip = namei(path)) == 0) {
+    end_op();
     return -ENOENT;
   }
 
+  ilock(ip);
   stati(ip, (struct stat *)buf);
+  iunlockput(ip);
+  end_op();
 
   return 0;
 }
@@ -477,6 +479,233 @@ uint64 xv6fs_lseek(void) {
   return fileseek(f, (off_t)off, whence);
 }
 
+uint64 xv6fs_fallocate(void) {
+  struct file *f;
+  uint64 off, len;
+
+  argaddr(1, &off);
+  argaddr(2, &len);
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return fileallocate(f, off, len);
+}
+
+uint64 xv6fs_getdents(void) {
+  struct file *f;
+  uint64 p, cookie;
+  int n;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argaddr(3, &cookie);
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return filegetdents(f, p, n, cookie);
+}
+
+uint64 xv6fs_preadv(void) {
+  struct file *f;
+  uint64 p;
+  int cnt;
+
+  argaddr(1, &p);
+  argint(2, &cnt);
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return filerwv(f, p, cnt, 0);
+}
+
+uint64 xv6fs_pwritev(void) {
+  struct file *f;
+  uint64 p;
+  int cnt;
+
+  argaddr(1, &p);
+  argint(2, &cnt);
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return filerwv(f, p, cnt, 1);
+}
+
+// Streaming pread and pwrite: fd, area, area size, off, len.
+static uint64 xv6fs_stream(int write) {
+  struct file *f;
+  uint64 p, off, len;
+  int size;
+
+  argaddr(1, &p);
+  argint(2, &size);
+  argaddr(3, &off);
+  argaddr(4, &len);
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  // the halves are polled while the client fills or drains them.
+  if (size < 0 || p % 8 || !mapshared(p, size))
+    return -EINVAL;
+  return filestream(f, p, size, off, len, write);
+}
+
+uint64 xv6fs_pread_stream(void) { return xv6fs_stream(0); }
+
+uint64 xv6fs_pwrite_stream(void) { return xv6fs_stream(1); }
+
+uint64 xv6fs_fsync(void) {
+  struct file *f;
+
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return filesync(f, 0);
+}
+
+uint64 xv6fs_fdatasync(void) {
+  struct file *f;
+
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return filesync(f, 1);
+}
+
+// Map a file range into the shared window: fd, off, len, writable.
+// Returns the window offset of the mapping.
+uint64 xv6fs_mmap(void) {
+  struct file *f;
+  int off, len, writable;
+
+  argint(1, &off);
+  argint(2, &len);
+  argint(3, &writable);
+  if (argfd(0, 0, &f) < 0)
+    return -EBADF;
+  return mapfile(f, off, len, writable);
+}
+
+// Write back part of a mapping: window offset, len.
+uint64 xv6fs_msync(void) {
+  int woff, len;
+
+  argint(0, &woff);
+  argint(1, &len);
+  return mapsync(woff, len);
+}
+
+// Write back and remove a mapping: window offset.
+uint64 xv6fs_munmap(void) {
+  int woff;
+
+  argint(0, &woff);
+  return unmapfile(woff);
+}
+
+// Map region i of a shared-memory object into the window:
+// name, i, region size. Returns the region's window offset.
+uint64 xv6fs_shm_map(void) {
+  char name[MAXPATH];
+  int i, size;
+
+  argint(1, &i);
+  argint(2, &size);
+  if (argstr(0, name, MAXPATH) < 0)
+    return -EINVAL;
+  return shmmap(name, i, size);
+}
+
+// Delete a shared-memory object: name.
+uint64 xv6fs_shm_unmap(void) {
+  char name[MAXPATH];
+
+  if (argstr(0, name, MAXPATH) < 0)
+    return -EINVAL;
+  return shmunmap(name);
+}
+
+// Publish per-fd offsets and stat: window offset of a struct
+// fsleases.
+uint64 xv6fs_lease_setup(void) {
+  int woff;
+
+  argint(0, &woff);
+  return leasesetup(woff);
+}
+
+// Run one operation of an FS_COMPOUND request whose buffer is
+// the len bytes at buf. *prevfd is the fd of the last FS_OPEN.
+static long compoundop(struct fsop *o, char *buf, uint len, int *prevfd) {
+  char path[MAXPATH];
+  struct file *f;
+  int fd;
+
+  fd = o->fd == FSC_PREVFD ? *prevfd : o->fd;
+  if (o->op != FS_OPEN &&
+      (fd < 0 || fd >= NOFILE || (f = curr()->ofile[fd]) == 0))
+    return -EBADF;
+  if (o->data > len)
+    return -EINVAL;
+  switch (o->op) {
+  case FS_OPEN:
+    if (memchr(buf + o->data, 0, len - o->data) == 0)
+      return -EINVAL;
+    strncpy(path, buf + o->data, MAXPATH - 1);
+    path[MAXPATH - 1] = 0;
+    if ((fd = openpath(path, o->arg)) >= 0)
+      *prevfd = fd;
+    return fd;
+  case FS_CLOSE:
+    curr()->ofile[fd] = 0;
+    fileclose(f);
+    return 0;
+  case FS_FSTAT:
+    if (len - o->data < sizeof(struct stat))
+      return -EINVAL;
+    return filestat(f, (uint64)(buf + o->data));
+  case FS_LSEEK:
+    return fileseek(f, (off_t)o->arg, o->len);
+  case FS_PREAD:
+  case FS_PWRITE:
+    if (o->len > len - o->data)
+      return -EINVAL;
+    return filerwat(f, (uint64)(buf + o->data), o->len, o->arg,
+                    o->op == FS_PWRITE);
+  case FS_FSYNC:
+    return filesync(f, 0);
+  default:
+    return -EINVAL;
+  }
+}
+
+// Run a short program of operations in one request: buf, cnt,
+// len (see struct fsop). Returns how many succeeded; the one after
+// them, if any, holds the error that stopped the program.
+uint64 xv6fs_compound(void) {
+  struct fsop *o;
+  uint64 p;
+  int cnt, len, i, prevfd;
+
+  argaddr(0, &p);
+  argint(1, &cnt);
+  argint(2, &len);
+  if (cnt < 0 || len < 0 || (uint)cnt > len / sizeof(struct fsop))
+    return -EINVAL;
+  o = (struct fsop *)p;
+  prevfd = -1;
+  for (i = 0; i < cnt; i++) {
+    o[i].ret = compoundop(&o[i], (char *)p, len, &prevfd);
+    if (o[i].ret < 0)
+      break;
+  }
+  return i;
+}
+
+// Register the async queues: window offset of a struct fsring.
+uint64 xv6fs_async_setup(void) {
+  int woff;
+
+  argint(0, &woff);
+  return asyncsetup(woff);
+}
+
+// Run the submitted async requests now. Returns how many ran.
+uint64 xv6fs_async_enter(void) { return asyncrun(NFSRING); }
+
 // uint64 sys_pipe(void) {
 //   uint64 fdarray; // user pointer to array of two integers
 //   struct file *rf, *wf;